@@ -1,8 +1,11 @@
 
+#include <algorithm>
+#include <cctype>
 #include <chrono>
 #include <cmath>
 #include <fstream>
 #include <stdexcept>
+#include <thread>
 
 #include "clap.hpp"
 #include "ensemble.hpp"
@@ -63,9 +66,9 @@ try
                  "1");
 
   c.add_argument("Multi Threaded",
-                 "Use multiple threads (Y/N)",
+                 "Use multiple threads (Y/N, or the number of threads)",
                  { "-t", "--threads" },
-                 { "Y", "yes", "N", "no" },
+                 {},
                  "N");
 
   c.add_argument("Use PWMs",
@@ -76,11 +79,18 @@ try
 
   c.add_argument(
       "Adjust Weights",
-      "Adjust weights according to similarity (Y/N/U) Y requires percentage",
+      "Adjust weights according to similarity (Y/N/U/L) Y and L (approximate, "
+      "by LSH) require percentage",
       { "-a", "--adjust-weights" },
-      { "U", "uniform", "Y", "yes", "N", "no" },
+      { "U", "uniform", "Y", "yes", "L", "lsh", "N", "no" },
       "N");
 
+  c.add_argument("Deduplicate",
+                 "Collapse identical sequences before weighting (Y/N)",
+                 { "-dd", "--deduplicate" },
+                 { "Y", "yes", "N", "no" },
+                 "N");
+
   c.add_argument("Similarity Percentage",
                  "Percentage similarity threshold for weights",
                  { "-sim", "--similarity" },
@@ -99,6 +109,26 @@ try
                  { "Y", "yes", "N", "no" },
                  "N");
 
+  c.add_argument("Table Backend",
+                 "Storage for order 3 and 4 tables "
+                 "(auto/dense/sparse/external)",
+                 { "-tb", "--table-backend" },
+                 { "auto", "dense", "sparse", "external" },
+                 "auto");
+
+  c.add_argument("Max Memory",
+                 "Memory limit for the PWMs, in MiB or with a K/M/G suffix "
+                 "(0 for none)",
+                 { "-mm", "--max-memory" },
+                 {},
+                 "0");
+
+  c.add_argument("Count Engine",
+                 "Counting of order 2 and 3 terms (scan/bitset)",
+                 { "-ce", "--count-engine" },
+                 { "scan", "bitset" },
+                 "scan");
+
   auto const args = c.parse_arguments(argc, argv);
 
   try
@@ -110,6 +140,23 @@ try
     std::cout << "Error: Replicate must be an integer\n";
     throw sic::EnsembleError{};
   }
+  auto threads = 1u;
+  if (auto const thread_arg = args.at("Multi Threaded");
+      thread_arg == "Y" or thread_arg == "yes")
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  else if (thread_arg != "N" and thread_arg != "no")
+    try
+    {
+      auto const count = std::stoi(thread_arg);
+      if (count < 1)
+        throw std::invalid_argument("");
+      threads = static_cast<unsigned>(count);
+    }
+    catch (std::invalid_argument const &)
+    {
+      std::cout << "Error: Threads must be Y, N, or a positive integer\n";
+      throw sic::EnsembleError{};
+    }
   try
   {
     int fraction = std::stoi(args.at("Train Fraction"));
@@ -122,29 +169,65 @@ try
     throw sic::EnsembleError{};
   }
 
+  auto max_memory = std::size_t{ 0 };
+  try
+  {
+    auto const &memory_arg = args.at("Max Memory");
+    std::size_t digits     = 0;
+    max_memory             = std::stoull(memory_arg, &digits);
+    auto const suffix      = memory_arg.substr(digits);
+    if (not std::isdigit(static_cast<unsigned char>(memory_arg[0])) or
+        suffix.size() > 1)
+      throw std::invalid_argument("");
+    auto const shift = suffix.empty() or suffix == "M" or suffix == "m" ? 20
+                       : suffix == "K" or suffix == "k"                ? 10
+                       : suffix == "G" or suffix == "g"                ? 30
+                                                                        : -1;
+    if (shift < 0)
+      throw std::invalid_argument("");
+    max_memory <<= shift;
+  }
+  catch (std::logic_error const &)
+  {
+    std::cout << "Error: Max memory must be a size such as 512, 512M or 4G\n";
+    throw sic::EnsembleError{};
+  }
+
   auto start = std::chrono::system_clock::now();
   auto end   = std::chrono::system_clock::now();
 
-  auto [all_seqs, true_offset] =
+  auto [all_seqs, true_offset, true_target] =
       sic::extractA2MSequencesFromFile(args.at("Training File"));
 
   std::cout << "\n ---> Training file : " << args.at("Training File") << "\n";
 
-  auto const true_target = all_seqs[0].sequence;
-  sic::removeLowerCaseResidues(all_seqs, true_target);
-
   end = std::chrono::system_clock::now();
   std::cout << "time to extract and clean ";
   printTime(end - start);
   start = std::chrono::system_clock::now();
 
+  auto ensemble = sic::Ensemble(std::move(all_seqs));
+
+  if (auto const dedup = args.at("Deduplicate"); dedup == "Y" or dedup == "yes")
+  {
+    start = std::chrono::system_clock::now();
+    ensemble.deduplicate();
+
+    end = std::chrono::system_clock::now();
+    std::cout << "time to deduplicate ";
+    printTime(end - start);
+  }
+
   auto const adjust_arg = args.at("Adjust Weights");
 
+  // started once, and shared by weighting, PWM generation and testing
+  sic::ThreadPool pool{ threads };
+
   if (adjust_arg == "U" or adjust_arg == "uniform")
   {
     start = std::chrono::system_clock::now();
     std::cout << "Similarity percentage will be ignored if provided...\n";
-    sic::adjustWeightsUniformly(all_seqs);
+    ensemble.adjustWeightsUniformly(pool);
 
     end = std::chrono::system_clock::now();
     std::cout << "time to adjust weights (uniform) ";
@@ -155,34 +238,71 @@ try
   {
     auto const sim_perc = std::stoi(args.at("Similarity Percentage"));
     start               = std::chrono::system_clock::now();
-    sic::adjustWeights(all_seqs, sim_perc);
+    ensemble.adjustWeights(sim_perc, pool);
 
     end = std::chrono::system_clock::now();
     std::cout << "time to adjust weights (by similarity) ";
     printTime(end - start);
   }
 
-  auto ensemble = sic::Ensemble(all_seqs);
+  if (adjust_arg == "L" or adjust_arg == "lsh")
+  {
+    auto const sim_perc = std::stoi(args.at("Similarity Percentage"));
+    start               = std::chrono::system_clock::now();
+    ensemble.adjustWeightsApproximately(sim_perc, pool);
+
+    end = std::chrono::system_clock::now();
+    std::cout << "time to adjust weights (by similarity, approximate) ";
+    printTime(end - start);
+  }
 
-  if (auto const summary = args.at("Summarize");
-      summary == "Y" or summary == "yes")
+  auto const summary_arg = args.at("Summarize");
+  auto const summarize   = summary_arg == "Y" or summary_arg == "yes";
+  if (summarize)
     ensemble.print_summary();
 
-  auto const thread_arg  = args.at("Multi Threaded");
-  auto const use_threads = thread_arg == "Y" or thread_arg == "yes";
-
   auto const use_pwms_arg = args.at("Use PWMs");
   auto const use_pwms     = use_pwms_arg == "Y" or use_pwms_arg == "yes";
 
   auto const use_bias_arg = args.at("Use Bias");
   auto const use_bias     = use_bias_arg == "Y" or use_bias_arg == "yes";
 
+  auto const backend_arg = args.at("Table Backend");
+  auto const backend =
+      backend_arg == "dense"      ? sic::Backend::Dense
+      : backend_arg == "sparse"   ? sic::Backend::Sparse
+      : backend_arg == "external" ? sic::Backend::External
+                                  : sic::Backend::Auto;
+
+  auto const engine = args.at("Count Engine") == "bitset"
+                          ? sic::CountEngine::Bitset
+                          : sic::CountEngine::Scan;
+
+  auto const pseudo_count_arg = args.at("Pseudo Count");
+  auto const pseudo_count =
+      1.0 / std::pow(10.0, std::stod(pseudo_count_arg));
+
   std::tuple<sic::PWM_1, sic::PWM_2, sic::PWM_3, sic::PWM_4> all_pwms;
   if (use_pwms)
   {
+    // planned up front, so that PWMs that cannot fit fail before any work
+    auto const plan = sic::MemoryPlan{ ensemble,
+                                       std::stoi(args.at("PWMSize")),
+                                       pool.size(),
+                                       backend,
+                                       engine,
+                                       max_memory };
+    if (summarize or max_memory)
+      plan.print();
+
     start    = std::chrono::system_clock::now();
-    all_pwms = sic::generatePWMs(
-        ensemble, std::stoi(args.at("PWMSize")), use_threads);
+    all_pwms = sic::generatePWMs(ensemble,
+                                 std::stoi(args.at("PWMSize")),
+                                 pool,
+                                 plan,
+                                 engine,
+                                 pseudo_count,
+                                 use_bias);
     end = std::chrono::system_clock::now();
     std::cout << "time to generate ";
     printTime(end - start);
@@ -190,30 +310,28 @@ try
 
   std::cout << "\n ---> Testing file : " << args.at("Testing File") << "\n";
 
-  auto pseudo_count_arg = args.at("Pseudo Count");
 
   auto out_file_name = args.at("Testing File");
   if (auto slash = out_file_name.find_last_of('/'); slash != std::string::npos)
     out_file_name = out_file_name.substr(slash + 1);
 
   out_file_name = out_file_name.substr(0, out_file_name.find('.'));
-  if (adjust_arg == "Y" or adjust_arg == "yes")
+  if (adjust_arg == "Y" or adjust_arg == "yes" or adjust_arg == "L" or
+      adjust_arg == "lsh")
     out_file_name +=
         "_" + args.at("Similarity Percentage") + "_" + pseudo_count_arg;
 
-  auto const pseudo_count = 1.0 / std::pow(10.0, std::stod(pseudo_count_arg));
 
   start = std::chrono::system_clock::now();
   if (use_pwms)
     sic::testA2M(out_file_name,
                  args.at("Testing File"),
                  true_target,
+                 ensemble,
                  all_pwms,
                  std::stoi(args.at("PWMSize")),
                  true_offset,
-                 use_threads,
-                 pseudo_count,
-                 use_bias);
+                 pool);
   else
     sic::testA2MWithoutPWMs(out_file_name,
                             args.at("Testing File"),
@@ -221,9 +339,11 @@ try
                             ensemble,
                             std::stoi(args.at("PWMSize")),
                             true_offset,
-                            use_threads,
+                            pool,
                             pseudo_count,
-                            use_bias);
+                            use_bias,
+                            backend,
+                            engine);
 
   end = std::chrono::system_clock::now();
   std::cout << "time to test ";
@@ -0,0 +1,199 @@
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <iostream>
+#include <mutex>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <zlib.h>
+
+#include "compressed.hpp"
+#include "ensemble.hpp"
+
+namespace sic
+{
+namespace
+{
+// the stream buffer of a plain or gzip compressed file, filled by a reading
+// thread; zlib passes plain files through as they are
+class ReadAheadBuffer : public std::streambuf
+{
+private:
+  static constexpr std::size_t block_bytes = 1 << 20;
+  static constexpr std::size_t blocks      = 4;
+
+  std::string                    path;
+  gzFile                         file;
+  std::vector<std::vector<char>> ring;
+  std::vector<std::size_t>       lengths;
+
+  std::mutex              mutex;
+  std::condition_variable produced;
+  std::condition_variable released;
+  std::size_t             filled   = 0;   // blocks inflated so far
+  std::size_t             consumed = 0;   // blocks read and given back
+  bool                    holding  = false;
+  bool                    finished = false;
+  bool                    failed   = false;
+  bool                    zstd     = false;
+  bool                    stopping = false;
+
+  std::thread inflater;
+
+  // inflates block after block while the ring has room for one
+  void
+      inflate()
+  {
+    for (;;)
+    {
+      {
+        std::unique_lock<std::mutex> lock{ mutex };
+        released.wait(lock,
+                      [&] { return filled - consumed < blocks or stopping; });
+        if (stopping)
+          return;
+      }
+      // neither filled nor given back, so the reader does not hold it
+      auto      &block = ring[filled % blocks];
+      auto const bytes = gzread(file, block.data(), block_bytes);
+      auto       error = Z_OK;
+      if (bytes <= 0)
+        gzerror(file, &error);
+
+      std::lock_guard<std::mutex> lock{ mutex };
+      if (filled == 0 and bytes >= 4 and gzdirect(file) and
+          std::string_view(block.data(), 4) == "\x28\xb5\x2f\xfd")
+        failed = zstd = true;
+      else if (bytes < 0 or error != Z_OK)
+        failed = true;
+      else if (bytes == 0)
+        finished = true;
+      else
+        lengths[filled++ % blocks] = bytes;
+      produced.notify_one();
+      if (failed or finished)
+        return;
+    }
+  }
+
+protected:
+  int_type
+      underflow() override
+  {
+    std::unique_lock<std::mutex> lock{ mutex };
+    if (holding)
+    {
+      ++consumed;
+      holding = false;
+      released.notify_one();
+    }
+    produced.wait(lock,
+                  [&] { return filled > consumed or finished or failed; });
+    if (filled > consumed)
+    {
+      auto &block = ring[consumed % blocks];
+      holding     = true;
+      setg(block.data(),
+           block.data(),
+           block.data() + lengths[consumed % blocks]);
+      return traits_type::to_int_type(*gptr());
+    }
+    if (zstd)
+    {
+      std::cout << "Error: " << path
+                << " is zstd compressed, which is not supported; recompress "
+                   "it with gzip\n";
+      throw EnsembleError{};
+    }
+    if (failed)
+    {
+      std::cout << "Error: cannot decompress " << path << "\n";
+      throw EnsembleError{};
+    }
+    return traits_type::eof();
+  }
+
+public:
+  explicit ReadAheadBuffer(std::string const &path)
+      : path(path), file(gzopen(path.c_str(), "rb")),
+        ring(blocks, std::vector<char>(block_bytes)), lengths(blocks)
+  {
+    if (not file)
+    {
+      std::cout << "Error: file " << path << " not found";
+      throw EnsembleError{};
+    }
+    gzbuffer(file, 1 << 17);
+    inflater = std::thread{ [this] { inflate(); } };
+  }
+
+  ReadAheadBuffer(ReadAheadBuffer const &) = delete;
+  ReadAheadBuffer &operator=(ReadAheadBuffer const &) = delete;
+
+  ~ReadAheadBuffer()
+  {
+    {
+      std::lock_guard<std::mutex> lock{ mutex };
+      stopping = true;
+    }
+    released.notify_one();
+    inflater.join();
+    gzclose(file);
+  }
+};
+}   // namespace
+
+bool
+    isGzipped(std::string_view text)
+{
+  return text.substr(0, 2) == "\x1f\x8b";
+}
+
+std::string
+    inflate(std::string_view text, std::string const &path)
+{
+  z_stream stream{};
+  // 16 selects the gzip format
+  if (inflateInit2(&stream, 16 + MAX_WBITS) != Z_OK)
+  {
+    std::cout << "Error: cannot decompress " << path << "\n";
+    throw EnsembleError{};
+  }
+  stream.next_in  = reinterpret_cast<Bytef *>(const_cast<char *>(text.data()));
+  stream.avail_in = text.size();
+
+  std::string result;
+  auto        status = Z_OK;
+  while (status != Z_STREAM_END or stream.avail_in)
+  {
+    // gzip allows several members to follow each other
+    if (status == Z_STREAM_END)
+      inflateReset(&stream);
+    auto const done = result.size();
+    result.resize(std::max<std::size_t>(2 * done, 1 << 16));
+    stream.next_out  = reinterpret_cast<Bytef *>(result.data() + done);
+    stream.avail_out = result.size() - done;
+    status           = ::inflate(&stream, Z_NO_FLUSH);
+    result.resize(result.size() - stream.avail_out);
+    if (status != Z_OK and status != Z_STREAM_END)
+    {
+      inflateEnd(&stream);
+      std::cout << "Error: cannot decompress " << path << "\n";
+      throw EnsembleError{};
+    }
+  }
+  inflateEnd(&stream);
+  return result;
+}
+
+InputFile::InputFile(std::string const &path)
+    : std::istream(nullptr), buffer(std::make_unique<ReadAheadBuffer>(path))
+{
+  rdbuf(buffer.get());
+  // so that errors thrown while reading reach the caller
+  exceptions(std::ios::badbit);
+}
+}   // namespace sic
@@ -0,0 +1,28 @@
+
+#pragma once
+
+#include <istream>
+#include <memory>
+#include <streambuf>
+#include <string>
+#include <string_view>
+
+namespace sic
+{
+// whether the text starts with the gzip magic bytes
+bool isGzipped(std::string_view text);
+
+// the inflated contents of gzip compressed text read from path
+std::string inflate(std::string_view text, std::string const &path);
+
+// an input stream over a plain or gzip compressed file, opened once and
+// read ahead by a thread of its own; read errors throw EnsembleError
+class InputFile : public std::istream
+{
+private:
+  std::unique_ptr<std::streambuf> buffer;
+
+public:
+  explicit InputFile(std::string const &path);
+};
+}   // namespace sic
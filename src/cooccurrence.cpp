@@ -0,0 +1,143 @@
+
+#include <algorithm>
+#include <map>
+#include <numeric>
+#include <vector>
+
+#include "cooccurrence.hpp"
+
+namespace sic
+{
+CooccurrenceIndex::CooccurrenceIndex(Ensemble const &ensemble)
+    : L(ensemble.summary.L), A(ensemble.summary.D + 1)
+{
+  ensemble.verify();
+  auto const N = ensemble.sequences.size();
+
+  // classes in increasing order of weight, so that counts are summed in a
+  // reproducible order
+  std::map<double, std::size_t> sizes;
+  for (auto const weight : ensemble.weights)
+    sizes[weight]++;
+
+  std::map<double, std::size_t> class_of;
+  std::size_t                   offset = 0;
+  for (auto const &[weight, size] : sizes)
+  {
+    auto const class_words = (size + 63) / 64;
+    class_of[weight]       = classes.size();
+    classes.push_back({ weight, class_words, offset });
+    offset += static_cast<std::size_t>(L) * A * class_words;
+    max_words = std::max(max_words, class_words);
+    words += class_words;
+  }
+  sequences = N;
+  bits.assign(offset, 0);
+
+  // the rank of each sequence within its class
+  std::vector<std::size_t> cls(N), rank(N), filled(classes.size(), 0);
+  for (std::size_t n = 0; n < N; ++n)
+  {
+    cls[n]  = class_of[ensemble.weights[n]];
+    rank[n] = filled[cls[n]]++;
+  }
+
+  present.assign(static_cast<std::size_t>(L) * A, 0);
+  for (int i = 0; i < L; ++i)
+  {
+    auto const column = ensemble.column(i);
+    for (std::size_t n = 0; n < N; ++n)
+    {
+      auto const &c = classes[cls[n]];
+      bits[c.offset + (i * A + column[n]) * c.words + rank[n] / 64] |=
+          std::uint64_t{ 1 } << (rank[n] % 64);
+      present[i * A + column[n]] = 1;
+    }
+  }
+
+  symbols.assign(L, 0);
+  for (int i = 0; i < L; ++i)
+    for (int a = 0; a < A; ++a)
+      symbols[i] += present[i * A + a];
+}
+
+double
+    CooccurrenceIndex::count(int i, std::uint8_t a) const
+{
+  auto total = 0.0;
+  for (auto const &cls : classes)
+  {
+    auto const x   = bitset(cls, i, a);
+    auto       pop = 0;
+    for (std::size_t w = 0; w < cls.words; ++w)
+      pop += __builtin_popcountll(x[w]);
+    total += cls.weight * pop;
+  }
+  return total;
+}
+
+double
+    CooccurrenceIndex::count(int i, std::uint8_t a, int j, std::uint8_t b) const
+{
+  auto total = 0.0;
+  for (auto const &cls : classes)
+  {
+    auto const x   = bitset(cls, i, a);
+    auto const y   = bitset(cls, j, b);
+    auto       pop = 0;
+    for (std::size_t w = 0; w < cls.words; ++w)
+      pop += __builtin_popcountll(x[w] & y[w]);
+    total += cls.weight * pop;
+  }
+  return total;
+}
+
+double
+    CooccurrenceIndex::count(int          i,
+                             std::uint8_t a,
+                             int          j,
+                             std::uint8_t b,
+                             int          k,
+                             std::uint8_t c) const
+{
+  auto total = 0.0;
+  for (auto const &cls : classes)
+  {
+    auto const x   = bitset(cls, i, a);
+    auto const y   = bitset(cls, j, b);
+    auto const z   = bitset(cls, k, c);
+    auto       pop = 0;
+    for (std::size_t w = 0; w < cls.words; ++w)
+      pop += __builtin_popcountll(x[w] & y[w] & z[w]);
+    total += cls.weight * pop;
+  }
+  return total;
+}
+
+ResidueIndex::ResidueIndex(Ensemble const &ensemble)
+    : A(ensemble.summary.D + 1)
+{
+  ensemble.verify();
+  auto const L = ensemble.summary.L;
+  auto const N = ensemble.sequences.size();
+
+  // a counting sort of every column, stable in the sequence ids
+  offsets.assign(static_cast<std::size_t>(L) * A + 1, 0);
+  for (int i = 0; i < L; ++i)
+  {
+    auto const column = ensemble.column(i);
+    for (std::size_t n = 0; n < N; ++n)
+      offsets[i * A + column[n] + 1]++;
+  }
+  std::partial_sum(std::begin(offsets), std::end(offsets), std::begin(offsets));
+
+  ids.resize(static_cast<std::size_t>(L) * N);
+  auto next = offsets;
+  for (int i = 0; i < L; ++i)
+  {
+    auto const column = ensemble.column(i);
+    for (std::size_t n = 0; n < N; ++n)
+      ids[next[i * A + column[n]]++] = static_cast<std::uint32_t>(n);
+  }
+}
+}   // namespace sic
@@ -0,0 +1,214 @@
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "ensemble.hpp"
+
+namespace sic
+{
+// how co-occurrence counts are computed: by scanning every sequence, or as
+// popcounts of ANDed (position, symbol) bitsets over the sequences
+enum class CountEngine
+{
+  Scan,
+  Bitset
+};
+
+// a bitset of the sequences with each (position, symbol) code, per class
+// of equal weight, so that weighted counts are sums of popcounts
+class CooccurrenceIndex
+{
+private:
+  struct WeightClass
+  {
+    double      weight;
+    std::size_t words;    // 64-bit words per bitset
+    std::size_t offset;   // of the class's L x (D + 1) bitsets in bits
+  };
+
+  int                        L;
+  int                        A;
+  std::vector<WeightClass>   classes;
+  std::vector<std::uint64_t> bits;
+  std::vector<std::uint8_t>  present;   // L x (D + 1), symbol occurs at i
+  std::vector<std::size_t>   symbols;   // number of symbols occurring at i
+  std::size_t                sequences = 0;
+  std::size_t                max_words = 0;
+  std::size_t                words     = 0;   // summed over all classes
+
+  std::uint64_t const *
+      bitset(WeightClass const &cls, int i, std::uint8_t a) const
+  {
+    return bits.data() + cls.offset + (i * A + a) * cls.words;
+  }
+
+public:
+  explicit CooccurrenceIndex(Ensemble const &ensemble);
+
+  std::size_t
+      weightClasses() const
+  {
+    return classes.size();
+  }
+
+  // whether ANDing bitsets at the positions is cheaper than scanning
+  bool
+      pays(int i, int j) const
+  {
+    return symbols[i] * symbols[j] * words <= sequences;
+  }
+  bool
+      pays(int i, int j, int k) const
+  {
+    return symbols[i] * symbols[j] * (symbols[k] + 1) * words <= sequences;
+  }
+
+  // weighted number of sequences with a at i (and b at j, and c at k)
+  double count(int i, std::uint8_t a) const;
+  double count(int i, std::uint8_t a, int j, std::uint8_t b) const;
+  double count(int          i,
+               std::uint8_t a,
+               int          j,
+               std::uint8_t b,
+               int          k,
+               std::uint8_t c) const;
+
+  // calls f(a, b, count) for every pair of codes that co-occurs at (i, j)
+  template <typename F>
+  void forEachPair(int i, int j, F &&f) const;
+
+  // calls f(a, b, c, count) for every triple of codes that co-occurs at
+  // (i, j, k)
+  template <typename F>
+  void forEachTriple(int i, int j, int k, F &&f) const;
+};
+
+// the ids of the sequences with each symbol at each position, in increasing
+// order
+class ResidueIndex
+{
+private:
+  int                        A;
+  std::vector<std::size_t>   offsets;   // into ids, by i * (D + 1) + a
+  std::vector<std::uint32_t> ids;
+
+public:
+  struct Ids
+  {
+    std::uint32_t const *first;
+    std::uint32_t const *last;
+
+    std::uint32_t const *
+        begin() const
+    {
+      return first;
+    }
+    std::uint32_t const *
+        end() const
+    {
+      return last;
+    }
+  };
+
+  explicit ResidueIndex(Ensemble const &ensemble);
+
+  // the sequences with a at i
+  Ids
+      sequences(int i, std::uint8_t a) const
+  {
+    auto const code = static_cast<std::size_t>(i) * A + a;
+    return { ids.data() + offsets[code], ids.data() + offsets[code + 1] };
+  }
+};
+
+template <typename F>
+void
+    CooccurrenceIndex::forEachPair(int i, int j, F &&f) const
+{
+  for (int a = 0; a < A; ++a)
+  {
+    if (not present[i * A + a])
+      continue;
+    for (int b = 0; b < A; ++b)
+    {
+      if (not present[j * A + b])
+        continue;
+      auto total = 0.0;
+      auto found = false;
+      for (auto const &cls : classes)
+      {
+        auto const x   = bitset(cls, i, a);
+        auto const y   = bitset(cls, j, b);
+        auto       pop = 0;
+        for (std::size_t w = 0; w < cls.words; ++w)
+          pop += __builtin_popcountll(x[w] & y[w]);
+        if (pop)
+        {
+          total += cls.weight * pop;
+          found = true;
+        }
+      }
+      if (found)
+        f(static_cast<std::uint8_t>(a), static_cast<std::uint8_t>(b), total);
+    }
+  }
+}
+
+template <typename F>
+void
+    CooccurrenceIndex::forEachTriple(int i, int j, int k, F &&f) const
+{
+  // the AND of the pair's bitsets, for every class
+  std::vector<std::uint64_t> scratch(classes.size() * max_words);
+  for (int a = 0; a < A; ++a)
+  {
+    if (not present[i * A + a])
+      continue;
+    for (int b = 0; b < A; ++b)
+    {
+      if (not present[j * A + b])
+        continue;
+      auto any = std::uint64_t{ 0 };
+      for (std::size_t n = 0; n < classes.size(); ++n)
+      {
+        auto const &cls = classes[n];
+        auto const  x   = bitset(cls, i, a);
+        auto const  y   = bitset(cls, j, b);
+        auto const  s   = scratch.data() + n * max_words;
+        for (std::size_t w = 0; w < cls.words; ++w)
+          any |= s[w] = x[w] & y[w];
+      }
+      if (not any)
+        continue;
+      for (int c = 0; c < A; ++c)
+      {
+        if (not present[k * A + c])
+          continue;
+        auto total = 0.0;
+        auto found = false;
+        for (std::size_t n = 0; n < classes.size(); ++n)
+        {
+          auto const &cls = classes[n];
+          auto const  s   = scratch.data() + n * max_words;
+          auto const  z   = bitset(cls, k, c);
+          auto        pop = 0;
+          for (std::size_t w = 0; w < cls.words; ++w)
+            pop += __builtin_popcountll(s[w] & z[w]);
+          if (pop)
+          {
+            total += cls.weight * pop;
+            found = true;
+          }
+        }
+        if (found)
+          f(static_cast<std::uint8_t>(a),
+            static_cast<std::uint8_t>(b),
+            static_cast<std::uint8_t>(c),
+            total);
+      }
+    }
+  }
+}
+}   // namespace sic
@@ -1,20 +1,28 @@
 
 #include <algorithm>
+#include <array>
 #include <cctype>
+#include <cerrno>
 #include <cmath>
+#include <cstdlib>
 #include <fstream>
 #include <functional>
 #include <iomanip>
 #include <iostream>
 #include <iterator>
+#include <memory>
 #include <numeric>
 #include <random>
 #include <regex>
 #include <sstream>
 #include <string>
+#include <string_view>
 #include <tuple>
 
+#include "compressed.hpp"
 #include "ensemble.hpp"
+#include "identity.hpp"
+#include "mapped.hpp"
 
 namespace sic
 {
@@ -29,26 +37,57 @@ std::vector<std::string>
   return v;
 }
 
+// the fields of a line at the given indices (-1 for none); false if the
+// line has too few fields
+template <std::size_t n>
+bool
+    projectFields(std::string_view                 line,
+                  char                             delim,
+                  std::array<int, n> const        &indices,
+                  std::array<std::string_view, n> &fields)
+{
+  auto const  last  = *std::max_element(std::begin(indices), std::end(indices));
+  std::size_t start = 0;
+  for (int f = 0; f <= last; ++f)
+  {
+    if (start > line.size())
+      return false;
+    auto end = line.find(delim, start);
+    if (end == std::string_view::npos)
+      end = line.size();
+    for (std::size_t k = 0; k < n; ++k)
+      if (indices[k] == f)
+        fields[k] = line.substr(start, end - start);
+    start = end + 1;
+  }
+  return true;
+}
+
 std::vector<Sequence>
     extractSequencesFromFile(std::string file,
                              std::string delimiter,
                              std::string sequence,
                              std::string label,
-                             std::string weight)
+                             std::string weight,
+                             ThreadPool &pool)
 {
-
-  std::ifstream ifs{ file };
-  if (not ifs.is_open())
+  // scanned in place; a compressed file is inflated into memory first
+  MappedFile const mapped{ file };
+  std::string      inflated;
+  auto             text = mapped.text();
+  if (isGzipped(text))
   {
-    std::cout << "Error: file " << file << " not found";
-    throw EnsembleError{};
+    inflated = inflate(text, file);
+    text     = inflated;
   }
   std::cout << "Loading file " << file << " ...\n";
 
-  std::string line;
-  char const  delim = delimiter[0];   // multi-char delimiters not supported
-  std::getline(ifs, line);
-  std::vector<std::string> columns = split(line, delim);
+  char const delim      = delimiter[0];   // multi-char delimiters not supported
+  auto const header_end = std::min(text.find('\n'), text.size());
+
+  std::vector<std::string> columns =
+      split(std::string{ text.substr(0, header_end) }, delim);
+  text.remove_prefix(std::min(header_end + 1, text.size()));
 
   auto column_index = [&](std::string field) -> int
   {
@@ -64,28 +103,101 @@ std::vector<Sequence>
     return std::distance(std::begin(columns), f);
   };
 
-  auto const sequence_index = column_index(sequence);
-  auto const label_index    = column_index(label);
-  auto const weight_index   = column_index(weight);
+  auto const indices = std::array<int, 3>{ column_index(sequence),
+                                           column_index(label),
+                                           column_index(weight) };
 
-  if (sequence_index == -1)
+  if (indices[0] == -1)
   {
     std::cout << "Error: " << sequence << " is not a column in " << file
               << " A valid column must be specified for sequences\n";
     throw EnsembleError{};
   }
 
-  std::vector<Sequence> all_sequences;
-  while (std::getline(ifs, line))
+  // the rows are parsed in chunks that end on line boundaries, a few per
+  // worker, and the chunks are concatenated in file order
+  struct Chunk
   {
-    auto const row = split(line, delim);
+    std::string_view      text;
+    std::vector<Sequence> sequences;
+    std::string_view      bad_line;   // the first line that failed, if any
+    char const           *error = nullptr;
+  };
 
-    all_sequences.push_back(
-        { row[sequence_index],
-          label == "__" ? label : row[label_index],
-          weight_index == -1 ? 1 : std::stod(row[weight_index]) });
+  auto const         count = std::size_t{ 4 } * pool.size();
+  std::vector<Chunk> chunks;
+  for (std::size_t begin = 0, c = 1; begin < text.size(); ++c)
+  {
+    auto end = c == count ? text.size() : text.size() * c / count;
+    if (end < begin)
+      end = begin;
+    end = std::min(text.find('\n', end), text.size());
+    chunks.push_back({ text.substr(begin, end - begin), {}, {} });
+    begin = end + 1;
   }
 
+  pool.parallelFor(
+      chunks.size(),
+      [&](std::size_t c, unsigned)
+      {
+        auto &chunk = chunks[c];
+        auto  rest  = chunk.text;
+        std::array<std::string_view, 3> fields;
+        while (not rest.empty())
+        {
+          auto const end  = std::min(rest.find('\n'), rest.size());
+          auto const line = rest.substr(0, end);
+          rest.remove_prefix(std::min(end + 1, rest.size()));
+          if (line.empty())
+            continue;
+
+          if (not projectFields(line, delim, indices, fields))
+          {
+            chunk.bad_line = line;
+            chunk.error    = "has too few columns";
+            return;
+          }
+          auto value = 1.0;
+          if (indices[2] != -1)
+          {
+            // read as std::stod reads it, with a sign, spaces or hex digits
+            std::string const weight_text{ fields[2] };
+            char             *end = nullptr;
+            errno                 = 0;
+            value = std::strtod(weight_text.c_str(), &end);
+            if (end == weight_text.c_str() or errno == ERANGE)
+            {
+              chunk.bad_line = line;
+              chunk.error    = "has a weight that is not a number";
+              return;
+            }
+          }
+          chunk.sequences.push_back(
+              { std::string{ fields[0] },
+                label == "__" ? label : std::string{ fields[1] },
+                value });
+        }
+      });
+
+  std::size_t total = 0;
+  for (auto const &chunk : chunks)
+  {
+    if (chunk.error)
+    {
+      std::cout << "Error: line \"" << chunk.bad_line << "\" of " << file
+                << " " << chunk.error << "\n";
+      throw EnsembleError{};
+    }
+    total += chunk.sequences.size();
+  }
+
+  std::vector<Sequence> all_sequences;
+  all_sequences.reserve(total);
+  for (auto &chunk : chunks)
+    std::move(std::begin(chunk.sequences),
+              std::end(chunk.sequences),
+              std::back_inserter(all_sequences));
+
   std::cout << "File " << file << " succesfully loaded.\n";
 
   return all_sequences;
@@ -119,31 +231,15 @@ std::vector<Sequence>
   return sequences;
 }
 
-void
-    removeLowerCaseResidues(std::vector<Sequence> &sequences,
-                            std::string const     &true_target)
-{
-  for (auto &[sequence, label, weight] : sequences)
-  {
-    std::string fixed_sequence;
-    for (int i = 0; i < static_cast<int>(sequence.length()); ++i)
-      if (not std::islower(true_target[i]))
-        fixed_sequence.push_back(sequence[i]);
-    sequence = fixed_sequence;
-  }
-}
-
-Ensemble::Ensemble(std::vector<Sequence> const &seqs)
+Ensemble::Ensemble(std::vector<Sequence> seqs)
 {
-  sequences = seqs;
-
-  if (sequences.empty())
+  if (seqs.empty())
   {
     std::cout << "Error: no sequences provided\n";
     throw EnsembleError{};
   }
 
-  for (auto const &[sequence, label, weight] : sequences)
+  for (auto const &[sequence, label, weight] : seqs)
   {
 
     summary.total_weight += weight;
@@ -162,9 +258,81 @@ Ensemble::Ensemble(std::vector<Sequence> const &seqs)
   for (auto const &symbol : summary.symbol_counts)
     summary.symbols.push_back(symbol.first);
 
-  summary.N = static_cast<int>(sequences.size());
+  summary.N = static_cast<int>(seqs.size());
   summary.D = static_cast<int>(summary.symbol_counts.size());
-  summary.L = static_cast<int>(sequences[0].sequence.size());
+  summary.L = static_cast<int>(seqs[0].sequence.size());
+
+  if (summary.D > 255)
+  {
+    std::cout << "Error: ensemble contains more than 255 different "
+                 "characters\n";
+    throw EnsembleError{};
+  }
+  summary.codes.fill(static_cast<std::uint8_t>(summary.D));
+  for (int a = 0; a < summary.D; ++a)
+    summary.codes[static_cast<unsigned char>(summary.symbols[a])] =
+        static_cast<std::uint8_t>(a);
+
+  // every text is released once encoded
+  sequences.reserve(seqs.size());
+  for (auto &[sequence, label, weight] : seqs)
+  {
+    sequences.push_back({ encode(sequence), weight });
+    std::string{}.swap(sequence);
+  }
+  seqs = {};
+  buildColumns();
+}
+
+void
+    Ensemble::deduplicate()
+{
+  std::unordered_map<std::string, std::size_t> first;
+  std::vector<EncodedSequence>                 unique;
+  for (auto &sequence : sequences)
+  {
+    auto const [it, inserted] = first.try_emplace(
+        std::string(std::begin(sequence.codes), std::end(sequence.codes)),
+        unique.size());
+    if (inserted)
+      unique.push_back(std::move(sequence));
+    else
+    {
+      unique[it->second].weight += sequence.weight;
+      unique[it->second].multiplicity += sequence.multiplicity;
+    }
+  }
+  sequences = std::move(unique);
+  buildColumns();
+}
+
+void
+    Ensemble::buildColumns()
+{
+  auto const N = sequences.size();
+  weights.resize(N);
+  for (std::size_t n = 0; n < N; ++n)
+    weights[n] = sequences[n].weight;
+
+  columns.clear();
+  if (not lengthsAligned())
+    return;
+  auto const L = static_cast<std::size_t>(summary.L);
+  columns.resize(L * N);
+  for (std::size_t n = 0; n < N; ++n)
+    for (std::size_t i = 0; i < L; ++i)
+      columns[i * N + n] = sequences[n].codes[i];
+}
+
+std::vector<std::uint8_t>
+    Ensemble::encode(std::string const &sequence) const
+{
+  std::vector<std::uint8_t> codes(sequence.size());
+  std::transform(std::begin(sequence),
+                 std::end(sequence),
+                 std::begin(codes),
+                 [this](char c) { return summary.encode(c); });
+  return codes;
 }
 
 void
@@ -172,7 +340,10 @@ void
 {
   std::cout << "\n------\nSummary report for ensemble"
             << "\n------\n";
-  std::cout << "Ensemble contains " << sequences.size() << " sequences\n";
+  std::cout << "Ensemble contains " << summary.N << " sequences";
+  if (sequences.size() != static_cast<std::size_t>(summary.N))
+    std::cout << " (" << sequences.size() << " distinct)";
+  std::cout << "\n";
   summary.print();
 }
 
@@ -216,15 +387,27 @@ std::string
   return res;
 }
 
-std::pair<std::vector<Sequence>, int>
+bool
+    extractSingleA2Msequence(std::istream            &is,
+                             std::vector<bool> const &keep,
+                             std::string             &sequence)
+{
+  std::string line;
+  std::size_t column = 0;
+  while (std::getline(is, line) and line[0] != '>')
+    for (auto const c : line)
+    {
+      if (column >= keep.size() or keep[column])
+        sequence.push_back(c);
+      ++column;
+    }
+  return column != 0;
+}
+
+std::tuple<std::vector<Sequence>, int, std::string>
     extractA2MSequencesFromFile(std::string file)
 {
-  std::ifstream ifs{ file };
-  if (not ifs.is_open())
-  {
-    std::cout << "Error: file " << file << " not found";
-    throw EnsembleError{};
-  }
+  InputFile ifs{ file };
 
   std::string line;
   std::getline(ifs, line);
@@ -238,58 +421,300 @@ std::pair<std::vector<Sequence>, int>
   }
   auto true_offset = std::stoi(m[1].str());
 
+  // the insert columns, lowercase in the target, are dropped from every
+  // sequence as it is read
+  auto const        target = extractSingleA2Msequence(ifs);
+  std::vector<bool> keep;
+  std::string       kept;
+  for (unsigned char c : target)
+  {
+    keep.push_back(not std::islower(c));
+    if (keep.back())
+      kept.push_back(c);
+  }
+
   std::vector<Sequence> result;
-  auto                  target = extractSingleA2Msequence(ifs);
-  result.push_back({ target, "__", 1.0 });
+  result.push_back({ kept, "__", 1.0 });
+  for (;;)
+  {
+    std::string sequence;
+    sequence.reserve(kept.size());
+    if (not extractSingleA2Msequence(ifs, keep, sequence))
+      break;
+    result.push_back({ std::move(sequence), "__", 1.0 });
+  }
 
-  std::string seq;
-  while (not(seq = extractSingleA2Msequence(ifs)).empty())
-    result.push_back({ seq, "__", 1.0 });
+  return { result, true_offset, target };
+}
 
-  return { result, true_offset };
+// the smallest number of identities above the similarity threshold
+std::size_t
+    similarityThreshold(int percentage, std::size_t length)
+{
+  return static_cast<std::size_t>(
+      std::max(std::floor(percentage / 100.0 * length) + 1, 0.0));
 }
 
-void
-    adjustWeights(std::vector<Sequence> &seqs, int percentage)
+// number of sequences, copies included, that each sequence is similar to;
+// pairs are compared in tiles small enough to stay in L2
+template <typename Similar>
+std::vector<int>
+    countNeighbours(std::vector<EncodedSequence> const &sequences,
+                    ThreadPool                         &pool,
+                    Similar                             similar)
+{
+  constexpr std::size_t l2_bytes = 256 * 1024;
+
+  auto const N      = sequences.size();
+  auto const length = N ? sequences[0].codes.size() : 0;
+  auto const tile   = std::max<std::size_t>(16, l2_bytes / 4 / (length + 1));
+  auto const tiles  = (N + tile - 1) / tile;
+
+  std::vector<std::pair<std::size_t, std::size_t>> pairs;
+  for (std::size_t a = 0; a < tiles; ++a)
+    for (std::size_t b = a; b < tiles; ++b)
+      pairs.emplace_back(a, b);
+
+  std::vector<std::vector<int>> counts(pool.size(), std::vector<int>(N, 0));
+  pool.parallelFor(pairs.size(),
+                   [&](std::size_t p, unsigned worker)
+                   {
+                     auto      &count  = counts[worker];
+                     auto const [a, b] = pairs[p];
+                     auto const a_end  = std::min(N, (a + 1) * tile);
+                     auto const b_end  = std::min(N, (b + 1) * tile);
+                     for (auto n = a * tile; n < a_end; ++n)
+                       for (auto m = a == b ? n : b * tile; m < b_end; ++m)
+                         if (similar(sequences[n], sequences[m]))
+                         {
+                           count[n] += sequences[m].multiplicity;
+                           if (m != n)
+                             count[m] += sequences[n].multiplicity;
+                         }
+                   });
+
+  for (unsigned t = 1; t < pool.size(); ++t)
+    for (std::size_t n = 0; n < N; ++n)
+      counts[0][n] += counts[t][n];
+  return counts[0];
+}
+
+// countNeighbours over pairs sharing an LSH band; each sequence is compared
+// to at most max_bucket of the sequences after it in a bucket
+template <typename Similar>
+std::vector<int>
+    countNeighboursLSH(std::vector<EncodedSequence> const &sequences,
+                       int                                 bands,
+                       int                                 rows,
+                       ThreadPool                         &pool,
+                       Similar                             similar)
 {
+  constexpr std::size_t max_bucket = 2048;
+  constexpr std::size_t block      = 256;
+
+  auto const N      = sequences.size();
+  auto const length = N ? static_cast<int>(sequences[0].codes.size()) : 0;
+
+  std::vector<int> all_positions(length);
+  std::iota(std::begin(all_positions), std::end(all_positions), 0);
+  std::mt19937 gen;   // fixed seed, so that weights are reproducible
 
-  for (auto &sequence : seqs)
+  struct Band
   {
-    auto matches = 0;
-    for (auto const &other : seqs)
+    std::vector<std::uint32_t> order;   // sequences sorted by bucket
+    std::vector<std::uint32_t> rank;    // of each sequence in order
+    std::vector<std::uint32_t> end;     // of the bucket of each position
+  };
+  std::vector<Band>          table(bands);
+  std::vector<std::uint32_t> key(N);
+  for (auto &band : table)
+  {
+    std::vector<int> positions;
+    std::sample(std::begin(all_positions),
+                std::end(all_positions),
+                std::back_inserter(positions),
+                rows,
+                gen);
+    for (std::size_t n = 0; n < N; ++n)
     {
-      auto sim = std::inner_product(std::begin(sequence.sequence),
-                                    std::end(sequence.sequence),
-                                    std::begin(other.sequence),
-                                    0,
-                                    std::plus{},
-                                    std::equal_to{});
-      if (sim > percentage / 100.0 * sequence.sequence.size())
-        matches++;
+      std::uint64_t k = 14695981039346656037ull;   // FNV-1a
+      for (auto const p : positions)
+        k = (k ^ sequences[n].codes[p]) * 1099511628211ull;
+      key[n] = static_cast<std::uint32_t>(k ^ (k >> 32));
+    }
+
+    band.order.resize(N);
+    std::iota(std::begin(band.order), std::end(band.order), 0);
+    std::stable_sort(std::begin(band.order),
+                     std::end(band.order),
+                     [&](auto x, auto y) { return key[x] < key[y]; });
+    band.rank.resize(N);
+    band.end.resize(N);
+    for (std::size_t p = N; p-- > 0;)
+    {
+      band.rank[band.order[p]] = p;
+      band.end[p] = p + 1 < N and key[band.order[p]] == key[band.order[p + 1]]
+                        ? band.end[p + 1]
+                        : p + 1;
     }
-    sequence.weight = 1. / matches;
   }
+
+  // stamped with n + 1 once compared to n, as pairs share many bands
+  std::vector<std::vector<int>> counts(pool.size(), std::vector<int>(N, 0));
+  std::vector<std::vector<std::uint32_t>> seen(pool.size());
+  pool.parallelFor(
+      (N + block - 1) / block,
+      [&](std::size_t task, unsigned worker)
+      {
+        auto &count = counts[worker];
+        auto &stamp = seen[worker];
+        stamp.resize(N, 0);
+        for (auto n = task * block; n < std::min(N, (task + 1) * block); ++n)
+          for (auto const &band : table)
+          {
+            std::size_t const p    = band.rank[n];
+            std::size_t const last = std::min<std::size_t>(
+                band.end[p], p + 1 + max_bucket);
+            for (auto q = p + 1; q < last; ++q)
+            {
+              auto const m = band.order[q];
+              if (stamp[m] == n + 1)
+                continue;
+              stamp[m] = n + 1;
+              if (similar(sequences[n], sequences[m]))
+              {
+                count[n] += sequences[m].multiplicity;
+                count[m] += sequences[n].multiplicity;
+              }
+            }
+          }
+      });
+
+  for (unsigned t = 1; t < pool.size(); ++t)
+    for (std::size_t n = 0; n < N; ++n)
+      counts[0][n] += counts[t][n];
+  for (std::size_t n = 0; n < N; ++n)
+    if (similar(sequences[n], sequences[n]))
+      counts[0][n] += sequences[n].multiplicity;
+  return counts[0];
+}
+
+void
+    Ensemble::adjustWeights(int percentage, ThreadPool &pool)
+{
+  verify();
+  auto const length = static_cast<std::size_t>(summary.L);
+  auto const enough = similarityThreshold(percentage, length);
+
+  assignWeights(countNeighbours(
+      sequences,
+      pool,
+      [&](EncodedSequence const &x, EncodedSequence const &y)
+      {
+        return countIdentical(
+                   x.codes.data(), y.codes.data(), length, enough) >= enough;
+      }));
 }
 
 void
-    adjustWeightsUniformly(std::vector<Sequence> &seqs)
+    Ensemble::adjustWeightsApproximately(int percentage, ThreadPool &pool)
 {
+  verify();
+  auto const length = static_cast<std::size_t>(summary.L);
+  auto const enough = similarityThreshold(percentage, length);
 
-  for (auto &sequence : seqs)
+  auto const similar = [&](EncodedSequence const &x, EncodedSequence const &y)
   {
-    auto matches = 0;
-    for (auto const &other : seqs)
-    {
-      auto sim = std::inner_product(std::begin(sequence.sequence),
-                                    std::end(sequence.sequence),
-                                    std::begin(other.sequence),
-                                    0,
-                                    std::plus{},
-                                    std::equal_to{});
-      matches += sim / static_cast<double>(other.sequence.size());
-    }
-    sequence.weight = matches / static_cast<double>(seqs.size());
+    return countIdentical(x.codes.data(), y.codes.data(), length, enough) >=
+           enough;
+  };
+
+  // a pair of identity t shares one of the bands with probability
+  // 1 - (1 - t^rows)^bands; rows is the largest value that still finds 99% of
+  // the pairs that are just similar enough
+  constexpr int bands    = 32;
+  auto const    t        = static_cast<double>(enough) / length;
+  auto const    per_band = 1 - std::pow(0.01, 1.0 / bands);
+  auto          rows     = summary.L;
+  if (t <= 0)
+    rows = 0;
+  else if (t < 1)
+    rows = std::clamp(
+        static_cast<int>(std::log(per_band) / std::log(t)), 1, summary.L);
+
+  auto const matches =
+      countNeighboursLSH(sequences, bands, rows, pool, similar);
+
+  // exact counts for a sample of sequences, to report how far off LSH is
+  auto const samples = std::min<std::size_t>(100, sequences.size());
+  std::vector<std::size_t> sampled;
+  std::vector<std::size_t> all(sequences.size());
+  std::iota(std::begin(all), std::end(all), 0);
+  std::sample(std::begin(all),
+              std::end(all),
+              std::back_inserter(sampled),
+              samples,
+              std::mt19937{});
+  auto exact_count = 0;
+  auto total_error = 0.0;
+  auto max_error   = 0.0;
+  for (auto const n : sampled)
+  {
+    auto exact = 0;
+    for (auto const &other : sequences)
+      if (similar(sequences[n], other))
+        exact += other.multiplicity;
+    auto const error =
+        exact ? static_cast<double>(exact - matches[n]) / exact : 0.0;
+    exact_count += exact == matches[n];
+    total_error += error;
+    max_error = std::max(max_error, error);
+  }
+  std::cout << "LSH weighting (" << bands << " bands of " << rows
+            << " positions): neighbour counts exact for " << exact_count
+            << " of " << samples << " sampled sequences, mean relative error "
+            << 100 * total_error / std::max<std::size_t>(samples, 1)
+            << "%, max " << 100 * max_error << "%\n";
+
+  assignWeights(matches);
+}
+
+void
+    Ensemble::assignWeights(std::vector<int> const &matches)
+{
+  summary.total_weight = 0;
+  for (std::size_t n = 0; n < sequences.size(); ++n)
+  {
+    sequences[n].weight = sequences[n].multiplicity * (1. / matches[n]);
+    weights[n]          = sequences[n].weight;
+    summary.total_weight += sequences[n].weight;
   }
 }
 
+void
+    Ensemble::adjustWeightsUniformly(ThreadPool &pool)
+{
+  verify();
+  auto const length = static_cast<std::size_t>(summary.L);
+
+  // a sequence's similarity to another only adds to its integral count when
+  // the two are identical, so the comparison can give up at a mismatch
+  auto const matches = countNeighbours(
+      sequences,
+      pool,
+      [&](EncodedSequence const &x, EncodedSequence const &y)
+      {
+        return countIdentical(
+                   x.codes.data(), y.codes.data(), length, length) == length;
+      });
+
+  summary.total_weight = 0;
+  for (std::size_t n = 0; n < sequences.size(); ++n)
+  {
+    sequences[n].weight = sequences[n].multiplicity *
+                          (matches[n] / static_cast<double>(summary.N));
+    weights[n] = sequences[n].weight;
+    summary.total_weight += sequences[n].weight;
+  }
+}
 }   // namespace sic
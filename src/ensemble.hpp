@@ -1,7 +1,9 @@
 
 #pragma once
 
+#include <array>
 #include <chrono>
+#include <cstdint>
 #include <iostream>
 #include <map>
 #include <set>
@@ -11,6 +13,8 @@
 #include <utility>
 #include <vector>
 
+#include "threadpool.hpp"
+
 namespace sic
 {
 struct EnsembleError
@@ -24,6 +28,13 @@ struct Sequence
   double      weight;
 };
 
+struct EncodedSequence
+{
+  std::vector<std::uint8_t> codes;
+  double                    weight;   // summed over all copies
+  int                       multiplicity = 1;
+};
+
 struct Summary
 {
   int                                 N;
@@ -33,7 +44,15 @@ struct Summary
   std::map<int, int>                  length_counts;
   std::map<char, std::pair<int, int>> symbol_counts;
   std::vector<char>                   symbols;
+  // dense code for every byte: the index of the symbol in symbols, or D for
+  // symbols that do not occur in the ensemble (tables reserve a slot for it)
+  std::array<std::uint8_t, 256>       codes;
 
+  std::uint8_t
+      encode(char c) const
+  {
+    return codes[static_cast<unsigned char>(c)];
+  }
   void print() const;
 };
 
@@ -51,12 +70,49 @@ class Ensemble
   friend class WT_PWM_3;
   friend class WT_PWM_4;
 
+  friend class CooccurrenceIndex;
+  friend class ResidueIndex;
+  friend class MemoryPlan;
+
+  friend std::size_t estimateDistinctTerms(Ensemble const &, int);
+
 private:
-  std::vector<Sequence> sequences;
-  Summary               summary;
+  std::vector<EncodedSequence> sequences;   // encoded by summary.codes
+  Summary                      summary;
+  // position-major copy of the codes (L x N) and the sequence weights, laid
+  // out contiguously for the counting kernels; only built when aligned
+  std::vector<std::uint8_t>    columns;
+  std::vector<double>          weights;
+
+  void buildColumns();
+  // weights each sequence by the inverse of its number of neighbours
+  void assignWeights(std::vector<int> const &matches);
+  std::uint8_t const *
+      column(int i) const
+  {
+    return columns.data() + i * sequences.size();
+  }
 
 public:
-  Ensemble(std::vector<Sequence> const &seqs);
+  Ensemble(std::vector<Sequence> seqs);
+  std::uint8_t
+      encode(char c) const
+  {
+    return summary.encode(c);
+  }
+  std::vector<std::uint8_t> encode(std::string const &sequence) const;
+
+  // collapses identical sequences into their first occurrence, counting the
+  // copies it stands for
+  void deduplicate();
+
+  // similarity weighting, comparing sequences on the workers of pool
+  void adjustWeights(int percentage, ThreadPool &pool);
+  // like adjustWeights, but only compares the candidate neighbours found by
+  // banded Hamming LSH; reports its error against exact counts on a sample
+  void adjustWeightsApproximately(int percentage, ThreadPool &pool);
+  void adjustWeightsUniformly(ThreadPool &pool);
+
   void print_summary() const;
   bool
       lengthsAligned() const
@@ -75,19 +131,27 @@ public:
   }
 };
 
-void removeLowerCaseResidues(std::vector<Sequence> &sequences,
-                             std::string const     &true_target);
-
 std::string extractSingleA2Msequence(std::istream &is);
 
-std::pair<std::vector<Sequence>, int>
+// appends the columns of the next A2M record that keep marks, and all those
+// beyond it, to sequence; false if the record is empty
+bool extractSingleA2Msequence(std::istream            &is,
+                              std::vector<bool> const &keep,
+                              std::string             &sequence);
+
+// the sequences of an A2M file without the insert columns of the target
+// (its first sequence), the offset of the target, and the whole target
+std::tuple<std::vector<Sequence>, int, std::string>
     extractA2MSequencesFromFile(std::string file);
 
+// the sequence, label and weight columns of a delimited file, of which only
+// the named columns are parsed, a chunk of rows per task of pool
 std::vector<Sequence> extractSequencesFromFile(std::string file,
                                                std::string delimiter,
                                                std::string sequence,
                                                std::string label,
-                                               std::string weight);
+                                               std::string weight,
+                                               ThreadPool &pool);
 
 void filter(std::vector<Sequence> &sequences, std::string value);
 
@@ -95,7 +159,4 @@ std::vector<Sequence>
     sample(std::vector<Sequence> const &sequences, int fraction, int replicate);
 
 std::vector<std::string> split(std::string const &, char delim);
-
-void adjustWeights(std::vector<Sequence> &seqs, int percentage);
-void adjustWeightsUniformly(std::vector<Sequence> &seqs);
 }   // namespace sic
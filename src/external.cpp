@@ -0,0 +1,257 @@
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <queue>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "ensemble.hpp"
+#include "external.hpp"
+
+namespace sic
+{
+// where runs are written: TMPDIR, or the system's temporary directory
+std::string
+    temporaryDirectory()
+{
+  std::error_code error;
+  auto const      directory = std::filesystem::temp_directory_path(error);
+  if (error)
+  {
+    std::cout << "Error: cannot use the temporary directory for external "
+                 "tables: "
+              << error.message() << "\n";
+    throw EnsembleError{};
+  }
+  return directory.string();
+}
+
+ExternalTable::ExternalTable(std::size_t memory_budget)
+    : directory(temporaryDirectory()),
+      buffer_records(
+          std::max<std::size_t>(io_records, memory_budget / sizeof(Record)))
+{
+  // reserved up front, so that growing it never overshoots the budget
+  buffer.reserve(buffer_records);
+}
+
+ExternalTable::~ExternalTable()
+{
+  if (records)
+    munmap(const_cast<Record *>(records), count * sizeof(Record));
+  if (fd != -1)
+    close(fd);
+  if (not path.empty())
+    std::remove(path.c_str());
+  for (auto const &run : runs)
+    std::remove(run.c_str());
+}
+
+std::string
+    ExternalTable::nextFile()
+{
+  static std::atomic<unsigned> files{ 0 };
+  return directory + "/sic." + std::to_string(getpid()) + "." +
+         std::to_string(files++) + ".run";
+}
+
+void
+    ExternalTable::flush()
+{
+  if (buffer.empty())
+    return;
+  // stable, so that equal keys are summed in the order they were added
+  std::stable_sort(std::begin(buffer),
+                   std::end(buffer),
+                   [](Record const &x, Record const &y)
+                   { return x.key < y.key; });
+  std::size_t last = 0;
+  for (std::size_t r = 1; r < buffer.size(); ++r)
+    if (buffer[r].key == buffer[last].key)
+      buffer[last].value += buffer[r].value;
+    else
+      buffer[++last] = buffer[r];
+  buffer.resize(last + 1);
+
+  runs.push_back(nextFile());
+  std::ofstream ofs{ runs.back(), std::ios::binary };
+  ofs.write(reinterpret_cast<char const *>(buffer.data()),
+            buffer.size() * sizeof(Record));
+  if (not ofs)
+  {
+    std::cout << "Error: cannot write table run " << runs.back() << "\n";
+    throw EnsembleError{};
+  }
+  buffer.clear();
+}
+
+void
+    ExternalTable::absorb(ExternalTable &other)
+{
+  flush();
+  other.flush();
+  runs.insert(std::end(runs), std::begin(other.runs), std::end(other.runs));
+  other.runs.clear();
+}
+
+std::size_t
+    ExternalTable::merge(std::vector<std::string> const       &inputs,
+                         std::string const                    &output,
+                         std::function<double(double)> const &f)
+{
+  struct Run
+  {
+    std::ifstream       ifs;
+    std::vector<Record> chunk;
+    std::size_t         next = 0;
+
+    bool
+        advance()
+    {
+      if (++next < chunk.size())
+        return true;
+      chunk.resize(io_records);
+      ifs.read(reinterpret_cast<char *>(chunk.data()),
+               io_records * sizeof(Record));
+      chunk.resize(ifs.gcount() / sizeof(Record));
+      next = 0;
+      return not chunk.empty();
+    }
+  };
+
+  std::vector<Run> readers(inputs.size());
+  // (key, run) pairs, so that equal keys are summed in run order
+  std::priority_queue<std::pair<std::uint64_t, std::size_t>,
+                      std::vector<std::pair<std::uint64_t, std::size_t>>,
+                      std::greater<>>
+      heap;
+  for (std::size_t r = 0; r < inputs.size(); ++r)
+  {
+    readers[r].ifs.open(inputs[r], std::ios::binary);
+    if (not readers[r].ifs)
+    {
+      std::cout << "Error: cannot read table run " << inputs[r] << "\n";
+      throw EnsembleError{};
+    }
+    readers[r].next = readers[r].chunk.size() - 1;   // forces a first read
+    if (readers[r].advance())
+      heap.emplace(readers[r].chunk[0].key, r);
+  }
+
+  std::ofstream       ofs{ output, std::ios::binary };
+  std::vector<Record> out;
+  out.reserve(io_records);
+  std::size_t written = 0;
+  auto const  write   = [&]
+  {
+    ofs.write(reinterpret_cast<char const *>(out.data()),
+              out.size() * sizeof(Record));
+    written += out.size();
+    out.clear();
+  };
+
+  while (not heap.empty())
+  {
+    auto const key   = heap.top().first;
+    auto       value = 0.0;
+    while (not heap.empty() and heap.top().first == key)
+    {
+      auto const r = heap.top().second;
+      heap.pop();
+      value += readers[r].chunk[readers[r].next].value;
+      if (readers[r].advance())
+        heap.emplace(readers[r].chunk[readers[r].next].key, r);
+    }
+    out.push_back({ key, f(value) });
+    if (out.size() == io_records)
+      write();
+  }
+  write();
+  ofs.close();
+  if (not ofs)
+  {
+    std::cout << "Error: cannot write table " << output << "\n";
+    throw EnsembleError{};
+  }
+  // a run that failed part way would otherwise read as a shorter one
+  for (std::size_t r = 0; r < inputs.size(); ++r)
+    if (readers[r].ifs.bad())
+    {
+      std::cout << "Error: cannot read table run " << inputs[r] << "\n";
+      throw EnsembleError{};
+    }
+
+  for (auto const &input : inputs)
+    std::remove(input.c_str());
+  return written;
+}
+
+void
+    ExternalTable::finish(std::function<double(double)> const &f)
+{
+  flush();
+  buffer = std::vector<Record>{};
+
+  // at most max_fan_in runs are open at once
+  while (runs.size() > max_fan_in)
+  {
+    std::vector<std::string> merged;
+    for (std::size_t first = 0; first < runs.size(); first += max_fan_in)
+    {
+      auto const last = std::min(first + max_fan_in, runs.size());
+      merged.push_back(nextFile());
+      merge({ std::begin(runs) + first, std::begin(runs) + last },
+            merged.back(),
+            [](double value) { return value; });
+    }
+    runs = std::move(merged);
+  }
+
+  path  = nextFile();
+  count = merge(runs, path, f);
+  runs.clear();
+
+  if (count == 0)
+    return;
+  fd = open(path.c_str(), O_RDONLY);
+  auto const mapped =
+      fd == -1 ? MAP_FAILED
+               : mmap(nullptr, count * sizeof(Record), PROT_READ, MAP_SHARED,
+                      fd, 0);
+  if (mapped == MAP_FAILED)
+  {
+    std::cout << "Error: cannot map table " << path << "\n";
+    throw EnsembleError{};
+  }
+  records = static_cast<Record const *>(mapped);
+  for (std::size_t r = 0; r < count; r += index_stride)
+    index.push_back(records[r].key);
+}
+
+double
+    ExternalTable::find(std::uint64_t key, double missing) const
+{
+  auto const block = std::upper_bound(std::begin(index), std::end(index), key);
+  if (block == std::begin(index))
+    return missing;
+  auto const first =
+      records + (block - std::begin(index) - 1) * index_stride;
+  auto const last = std::min(first + index_stride, records + count);
+  auto const it = std::lower_bound(first,
+                                   last,
+                                   key,
+                                   [](Record const &r, std::uint64_t k)
+                                   { return r.key < k; });
+  return it != last and it->key == key ? it->value : missing;
+}
+}   // namespace sic
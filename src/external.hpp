@@ -0,0 +1,77 @@
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace sic
+{
+// out-of-core map from packed keys to doubles: full buffers are spilled as
+// sorted runs, which finish() merges into one mapped file; only find()
+// works after finish()
+class ExternalTable
+{
+public:
+  struct Record
+  {
+    std::uint64_t key;
+    double        value;
+  };
+
+  // records per read or write, and the smallest buffer
+  static constexpr std::size_t io_records = 1 << 16;
+
+private:
+  static constexpr std::size_t index_stride = 1024;
+  static constexpr std::size_t max_fan_in   = 64;
+
+  std::string                directory;
+  std::size_t                buffer_records;
+  std::vector<Record>        buffer;
+  std::vector<std::string>   runs;
+  std::string                path;
+  int                        fd      = -1;
+  Record const              *records = nullptr;
+  std::size_t                count   = 0;
+  std::vector<std::uint64_t> index;
+
+  std::string nextFile();
+  void        flush();
+  // merges and removes inputs, writing f(sum) per key; returns the count
+  std::size_t merge(std::vector<std::string> const       &inputs,
+                    std::string const                    &output,
+                    std::function<double(double)> const &f);
+
+public:
+  // buffers at most memory_budget bytes of records before spilling a run
+  explicit ExternalTable(std::size_t memory_budget);
+  ExternalTable(ExternalTable const &) = delete;
+  ExternalTable &operator=(ExternalTable const &) = delete;
+  ~ExternalTable();
+
+  void
+      add(std::uint64_t key, double value)
+  {
+    buffer.push_back({ key, value });
+    if (buffer.size() == buffer_records)
+      flush();
+  }
+
+  // takes over the runs and buffered values of other, leaving it empty
+  void absorb(ExternalTable &other);
+
+  // merges the runs, replacing every summed value v by f(v) on the way
+  void finish(std::function<double(double)> const &f);
+
+  std::size_t
+      size() const
+  {
+    return count;
+  }
+
+  double find(std::uint64_t key, double missing) const;
+};
+}   // namespace sic
@@ -1,7 +1,9 @@
 
+#include <algorithm>
+#include <cmath>
 #include <fstream>
-#include <ranges>
 #include <stdexcept>
+#include <thread>
 
 #include "clap.hpp"
 #include "ensemble.hpp"
@@ -84,6 +86,16 @@ try
                  { "-o", "--order" },
                  { "1", "2", "3", "4" },
                  "1");
+  c.add_argument("Multi Threaded",
+                 "Use multiple threads (Y/N, or the number of threads)",
+                 { "-t", "--threads" },
+                 {},
+                 "N");
+  c.add_argument("Pseudo Count",
+                 "Pseudo-count value N -> 1/10^N",
+                 { "-p", "--pseudo-count" },
+                 {},
+                 "6");
 
   auto const args = c.parse_arguments(argc, argv);
 
@@ -96,6 +108,23 @@ try
     std::cout << "Error: Replicate must be an integer\n";
     throw sic::EnsembleError{};
   }
+  auto threads = 1u;
+  if (auto const thread_arg = args.at("Multi Threaded");
+      thread_arg == "Y" or thread_arg == "yes")
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  else if (thread_arg != "N" and thread_arg != "no")
+    try
+    {
+      auto const count = std::stoi(thread_arg);
+      if (count < 1)
+        throw std::invalid_argument("");
+      threads = static_cast<unsigned>(count);
+    }
+    catch (std::invalid_argument const &)
+    {
+      std::cout << "Error: Threads must be Y, N, or a positive integer\n";
+      throw sic::EnsembleError{};
+    }
   try
   {
     int fraction = std::stoi(args.at("Train Fraction"));
@@ -108,12 +137,15 @@ try
     throw sic::EnsembleError{};
   }
 
+  sic::ThreadPool pool{ threads };
+
   auto all_seqs =
       sic::extractSequencesFromFile(args.at("Training File"),
                                     args.at("File Delimiter"),
                                     args.at("Train Sequence Column"),
                                     args.at("Train Label Column"),
-                                    args.at("Weight Column"));
+                                    args.at("Weight Column"),
+                                    pool);
 
   if (args.at("Train Label Value") == "__")
   {
@@ -129,25 +161,41 @@ try
 
   sic::filter(all_seqs, args.at("Train Label Value"));
 
-  auto const seqs = sic::sample(all_seqs,
-                                std::stoi(args.at("Train Fraction")),
-                                std::stoi(args.at("Replicate")));
+  auto seqs = sic::sample(all_seqs,
+                          std::stoi(args.at("Train Fraction")),
+                          std::stoi(args.at("Replicate")));
 
-  auto const ensemble = sic::Ensemble(seqs);
+  auto const ensemble = sic::Ensemble(std::move(seqs));
 
   if (auto const summary = args.at("Summarize");
       summary == "Y" or summary == "yes")
     ensemble.print_summary();
 
+  auto const pseudo_count =
+      1.0 / std::pow(10.0, std::stod(args.at("Pseudo Count")));
+  auto const order = std::stoi(args.at("PWMSize"));
+  auto const plan  = sic::MemoryPlan{ ensemble,
+                                     order,
+                                     pool.size(),
+                                     sic::Backend::Auto,
+                                     sic::CountEngine::Scan,
+                                     0 };
   auto const all_pwms =
-      sic::generatePWMs(ensemble, std::stoi(args.at("PWMSize")));
+      sic::generatePWMs(ensemble,
+                        order,
+                        pool,
+                        plan,
+                        sic::CountEngine::Scan,
+                        pseudo_count,
+                        false);
 
   auto test_seqs =
       sic::extractSequencesFromFile(args.at("Testing File"),
                                     args.at("File Delimiter"),
                                     args.at("Test Sequence Column"),
                                     args.at("Test Label Column"),
-                                    "__");
+                                    "__",
+                                    pool);
 
   auto const out_file_name =
       args.at("Training File") + "-" + args.at("Train Label Column") + "-" +
@@ -158,8 +206,9 @@ try
   sic::test(out_file_name,
             args.at("Test Label Column"),
             test_seqs,
+            ensemble,
             all_pwms,
-            std::stoi(args.at("PWMSize")));
+            order);
 
   return 0;
 }
@@ -0,0 +1,60 @@
+#ifdef __x86_64__
+#include <immintrin.h>
+#define SIC_X86
+#endif
+
+#include "gather.hpp"
+
+namespace sic
+{
+void
+    gatherAddScalar(double              *scores,
+                    double const        *table,
+                    std::uint32_t const *keys,
+                    std::size_t          begin,
+                    std::size_t          n)
+{
+  for (auto s = begin; s < n; ++s)
+    scores[s] += table[keys[s]];
+}
+
+#ifdef SIC_X86
+__attribute__((target("avx2"))) void
+    gatherAddAVX2(double              *scores,
+                  double const        *table,
+                  std::uint32_t const *keys,
+                  std::size_t          n)
+{
+  // the masked form, as the plain one trips -Wmaybe-uninitialized in GCC
+  auto const  all     = _mm256_castsi256_pd(_mm256_set1_epi64x(-1));
+  std::size_t s       = 0;
+  auto const  vectors = n - n % 4;
+  for (; s < vectors; s += 4)
+  {
+    auto const k = _mm_loadu_si128(reinterpret_cast<__m128i const *>(keys + s));
+    auto const v = _mm256_mask_i32gather_pd(
+        _mm256_setzero_pd(), table, k, all, sizeof(double));
+    _mm256_storeu_pd(scores + s,
+                     _mm256_add_pd(_mm256_loadu_pd(scores + s), v));
+  }
+  gatherAddScalar(scores, table, keys, s, n);
+}
+#endif
+
+void
+    gatherAdd(double              *scores,
+              double const        *table,
+              std::uint32_t const *keys,
+              std::size_t          n)
+{
+#ifdef SIC_X86
+  static bool const has_avx2 = __builtin_cpu_supports("avx2");
+  if (has_avx2)
+  {
+    gatherAddAVX2(scores, table, keys, n);
+    return;
+  }
+#endif
+  gatherAddScalar(scores, table, keys, 0, n);
+}
+}   // namespace sic
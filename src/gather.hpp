@@ -0,0 +1,15 @@
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace sic
+{
+// adds table[keys[s]] to scores[s] for every s < n, using AVX2 gathers
+// when available
+void gatherAdd(double              *scores,
+               double const        *table,
+               std::uint32_t const *keys,
+               std::size_t          n);
+}   // namespace sic
@@ -0,0 +1,105 @@
+
+#include <algorithm>
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#define SIC_X86
+#endif
+
+#include "identity.hpp"
+
+namespace sic
+{
+// the count is checked against enough after every block of this many bytes
+constexpr std::size_t identity_block = 256;
+
+std::size_t
+    countIdenticalScalar(std::uint8_t const *x,
+                         std::uint8_t const *y,
+                         std::size_t         begin,
+                         std::size_t         length,
+                         std::size_t         matches,
+                         std::size_t         enough)
+{
+  for (auto i = begin; i < length;)
+  {
+    auto const block_end = std::min(length, i + identity_block);
+    for (; i < block_end; ++i)
+      matches += x[i] == y[i];
+    if (matches >= enough or matches + (length - i) < enough)
+      break;
+  }
+  return matches;
+}
+
+#ifdef SIC_X86
+__attribute__((target("avx2,popcnt"))) std::size_t
+    countIdenticalAVX2(std::uint8_t const *x,
+                       std::uint8_t const *y,
+                       std::size_t         length,
+                       std::size_t         enough)
+{
+  std::size_t matches = 0;
+  std::size_t i       = 0;
+  auto const  vectors = length - length % 32;
+  while (i < vectors)
+  {
+    auto const block_end = std::min(vectors, i + identity_block);
+    for (; i < block_end; i += 32)
+    {
+      auto const a =
+          _mm256_loadu_si256(reinterpret_cast<__m256i const *>(x + i));
+      auto const b =
+          _mm256_loadu_si256(reinterpret_cast<__m256i const *>(y + i));
+      matches += _mm_popcnt_u32(static_cast<unsigned>(
+          _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b))));
+    }
+    if (matches >= enough or matches + (length - i) < enough)
+      return matches;
+  }
+  return countIdenticalScalar(x, y, i, length, matches, enough);
+}
+
+std::size_t
+    countIdenticalSSE2(std::uint8_t const *x,
+                       std::uint8_t const *y,
+                       std::size_t         length,
+                       std::size_t         enough)
+{
+  std::size_t matches = 0;
+  std::size_t i       = 0;
+  auto const  vectors = length - length % 16;
+  while (i < vectors)
+  {
+    auto const block_end = std::min(vectors, i + identity_block);
+    for (; i < block_end; i += 16)
+    {
+      auto const a = _mm_loadu_si128(reinterpret_cast<__m128i const *>(x + i));
+      auto const b = _mm_loadu_si128(reinterpret_cast<__m128i const *>(y + i));
+      matches += __builtin_popcount(
+          static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(a, b))));
+    }
+    if (matches >= enough or matches + (length - i) < enough)
+      return matches;
+  }
+  return countIdenticalScalar(x, y, i, length, matches, enough);
+}
+#endif
+
+std::size_t
+    countIdentical(std::uint8_t const *x,
+                   std::uint8_t const *y,
+                   std::size_t         length,
+                   std::size_t         enough)
+{
+#ifdef SIC_X86
+  static bool const has_avx2 = __builtin_cpu_supports("avx2") and
+                               __builtin_cpu_supports("popcnt");
+  if (has_avx2)
+    return countIdenticalAVX2(x, y, length, enough);
+  return countIdenticalSSE2(x, y, length, enough);
+#else
+  return countIdenticalScalar(x, y, 0, length, 0, enough);
+#endif
+}
+}   // namespace sic
@@ -0,0 +1,15 @@
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace sic
+{
+// number of positions at which x and y agree, exact only as far as which
+// side of enough it falls on; uses AVX2 or SSE2 when available
+std::size_t countIdentical(std::uint8_t const *x,
+                           std::uint8_t const *y,
+                           std::size_t         length,
+                           std::size_t         enough);
+}   // namespace sic
@@ -0,0 +1,76 @@
+
+#include <cerrno>
+#include <iostream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ensemble.hpp"
+#include "mapped.hpp"
+
+namespace sic
+{
+MappedFile::MappedFile(std::string const &path)
+{
+  fd = open(path.c_str(), O_RDONLY);
+  struct stat status;
+  if (fd == -1 or fstat(fd, &status) == -1)
+  {
+    if (fd != -1)
+      close(fd);
+    std::cout << "Error: file " << path << " not found";
+    throw EnsembleError{};
+  }
+
+  if (not S_ISREG(status.st_mode))
+  {
+    // a pipe or a device, whose length is only known once it is read
+    char buffer[1 << 16];
+    for (;;)
+    {
+      auto const bytes = read(fd, buffer, sizeof(buffer));
+      if (bytes == -1 and errno == EINTR)
+        continue;
+      if (bytes == -1)
+      {
+        close(fd);
+        std::cout << "Error: cannot read file " << path << "\n";
+        throw EnsembleError{};
+      }
+      if (bytes == 0)
+        break;
+      contents.append(buffer, bytes);
+    }
+    close(fd);
+    fd   = -1;
+    size = contents.size();
+    data = contents.data();
+    return;
+  }
+
+  size = status.st_size;
+  if (size == 0)   // an empty file cannot be mapped, and has nothing to read
+    return;
+
+  auto const mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (mapped == MAP_FAILED)
+  {
+    close(fd);
+    std::cout << "Error: cannot map file " << path << "\n";
+    throw EnsembleError{};
+  }
+  data = static_cast<char const *>(mapped);
+  // files are scanned once from start to end
+  madvise(mapped, size, MADV_SEQUENTIAL);
+}
+
+MappedFile::~MappedFile()
+{
+  if (data and fd != -1)
+    munmap(const_cast<char *>(data), size);
+  if (fd != -1)
+    close(fd);
+}
+}   // namespace sic
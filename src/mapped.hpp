@@ -0,0 +1,32 @@
+
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+namespace sic
+{
+// a whole file mapped read-only into memory, or read into it if it cannot
+// be mapped, as pipes cannot
+class MappedFile
+{
+private:
+  int         fd   = -1;
+  char const *data = nullptr;
+  std::size_t size = 0;
+  std::string contents;   // of a file that is not mapped
+
+public:
+  explicit MappedFile(std::string const &path);
+  MappedFile(MappedFile const &) = delete;
+  MappedFile &operator=(MappedFile const &) = delete;
+  ~MappedFile();
+
+  std::string_view
+      text() const
+  {
+    return { data, size };
+  }
+};
+}   // namespace sic
@@ -1,405 +1,1270 @@
 
 #include <algorithm>
+#include <array>
 #include <cassert>
+#include <charconv>
 #include <cctype>
 #include <chrono>
 #include <cmath>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <iterator>
+#include <limits>
 #include <map>
-#include <regex>
+#include <new>
+#include <numeric>
+#include <random>
 #include <set>
+#include <sstream>
 #include <string>
+#include <string_view>
 #include <thread>
 #include <tuple>
 #include <unordered_map>
 #include <utility>
 #include <vector>
 
+#include <unistd.h>
+
+#include "compressed.hpp"
 #include "ensemble.hpp"
+#include "gather.hpp"
+#include "mapped.hpp"
 #include "pwms.hpp"
 
 namespace sic
 {
 
-PWM_1::PWM_1(Ensemble const &ensemble, bool use_threads)
+std::vector<double>
+    biasedD(Summary const &summary, bool use_bias)
+{
+  // symbols absent from the ensemble have no frequency to bias by
+  std::vector<double> biased_D(summary.D + 1, summary.D);
+  if (use_bias)
+    for (int a = 0; a < summary.D; ++a)
+      biased_D[a] = static_cast<double>(summary.N * summary.L) /
+                    summary.symbol_counts.at(summary.symbols[a]).first;
+  return biased_D;
+}
+
+PWM_1::PWM_1(Ensemble const &ensemble,
+             ThreadPool     &pool,
+             double          c,
+             bool            use_bias)
     : summary(ensemble.summary)
 {
   ensemble.verify();
   auto const L = summary.L;
-  if (not use_threads)
-  {
-    pwm.clear();   // map had better be empty
-    for (auto const &sequence : ensemble.sequences)
-      for (int i = 0; i < L; ++i)
-        pwm[{ i, sequence.sequence[i] }] += sequence.weight;
+  auto const A = summary.D + 1;
 
-    for (auto &[key, val] : pwm)
-    {
-      val /= ensemble.summary.total_weight;
-    }
-  }
-  else
-  {
-    pwm_t = std::vector(L, std::map<char, double>{});
+  auto const N = ensemble.sequences.size();
+  auto const w = ensemble.weights.data();
 
-    std::vector<std::thread> v;
-    for (int i = 0; i < L; ++i)
-      v.emplace_back(
-          [&, i_t = i]
-          {
-            for (auto const &sequence : ensemble.sequences)
-              pwm_t[i_t][sequence.sequence[i_t]] += sequence.weight;
+  pwm.assign(L * A, 0.0);
+  pool.parallelFor(L,
+                   [&](std::size_t i, unsigned)
+                   {
+                     auto const row    = pwm.begin() + i * A;
+                     auto const column = ensemble.column(i);
+                     for (std::size_t n = 0; n < N; ++n)
+                       row[column[n]] += w[n];
 
-            for (auto &[key, val] : pwm_t[i_t])
-              val /= ensemble.summary.total_weight;
-          });
+                     for (int a = 0; a < A; ++a)
+                       row[a] /= ensemble.summary.total_weight;
+                   });
 
-    for (int i = 0; i < L; ++i)
-      v[i].join();
-  }
+  auto const biased_D = biasedD(summary, use_bias);
+  for (int i = 0; i < L; ++i)
+    for (int a = 0; a < A; ++a)
+      pwm[i * A + a] =
+          std::log(biased_D[a] * (pwm[i * A + a] + c)) / std::log(summary.D);
 }
 
-PWM_2::PWM_2(Ensemble const &ensemble, bool use_threads)
+PWM_2::PWM_2(Ensemble const          &ensemble,
+             ThreadPool              &pool,
+             double                   c,
+             bool                     use_bias,
+             CooccurrenceIndex const *index)
     : summary(ensemble.summary)
 {
   ensemble.verify();
   auto const L = summary.L;
-  if (not use_threads)
-  {
-    pwm.clear();   // map had better be empty
-    for (auto const &sequence : ensemble.sequences)
-    {
-      for (int i = 0; i < L; ++i)
-        for (int j = i + 1; j < L; ++j)
-          pwm[{ i, j, sequence.sequence[i], sequence.sequence[j] }] +=
-              sequence.weight;
-    }
+  auto const A = static_cast<std::size_t>(summary.D + 1);
 
-    for (auto &[key, val] : pwm)
-    {
-      val /= ensemble.summary.total_weight;
-    }
-  }
-  else
-  {
-    pwm_t = std::vector(L, std::map<std::tuple<int, char, char>, double>{});
+  auto const N = ensemble.sequences.size();
+  auto const w = ensemble.weights.data();
 
-    std::vector<std::thread> v;
-    for (int i = 0; i < L; ++i)
-      v.emplace_back(
-          [&, i_t = i]
-          {
-            for (auto const &sequence : ensemble.sequences)
-              for (int j = i_t + 1; j < L; ++j)
-                pwm_t[i_t]
-                     [{ j, sequence.sequence[i_t], sequence.sequence[j] }] +=
-                    sequence.weight;
+  // every pair is a task that counts and normalizes its own block
+  auto const pairs = allPairs(L);
+  pwm.assign(pairs.size() * A * A, 0.0);
+  pool.parallelFor(
+      pairs.size(),
+      [&](std::size_t t, unsigned)
+      {
+        auto const [i, j] = pairs[t];
+        auto const p      = pwm.begin() + t * A * A;
+        if (index and index->pays(i, j))
+          index->forEachPair(i,
+                             j,
+                             [&](std::uint8_t a, std::uint8_t b, double count)
+                             { p[a * A + b] = count; });
+        else
+        {
+          auto const column_i = ensemble.column(i);
+          auto const column_j = ensemble.column(j);
+          for (std::size_t n = 0; n < N; ++n)
+            p[column_i[n] * A + column_j[n]] += w[n];
+        }
 
-            for (auto &[key, val] : pwm_t[i_t])
-              val /= ensemble.summary.total_weight;
-          });
+        for (auto q = p; q != p + A * A; ++q)
+          *q /= ensemble.summary.total_weight;
+      });
+
+  auto const biased_D = biasedD(summary, use_bias);
+  auto       p        = pwm.begin();
+  for (std::size_t n = 0; n < pairCount(L); ++n)
+    for (std::size_t a = 0; a < A; ++a)
+      for (std::size_t b = 0; b < A; ++b, ++p)
+        *p = std::log(biased_D[a] * biased_D[b] * (*p + c)) /
+             std::log(summary.D);
+}
 
-    for (int i = 0; i < L; ++i)
-      v[i].join();
+void
+    checkKeyRange(Summary const &summary, int order)
+{
+  auto range = 1.0L;
+  for (int t = 0; t < order; ++t)
+    range *= static_cast<long double>(summary.L - t) / (t + 1) *
+             (summary.D + 1);
+  if (range >= 0x1p63L)
+  {
+    std::cout << "Error: PWM of order " << order
+              << " has too many terms to be indexed\n";
+    throw EnsembleError{};
   }
 }
 
-PWM_3::PWM_3(Ensemble const &ensemble, bool use_threads)
-    : summary(ensemble.summary)
+Backend
+    resolveBackend(Backend       backend,
+                   std::uint64_t key_range,
+                   std::size_t   expected_keys)
 {
-  ensemble.verify();
-  auto const L = summary.L;
+  if (backend != Backend::Auto)
+    return backend;
+  // a sparse entry holds a key and a value at a load factor of at most 1/2,
+  // so it costs at least four dense slots
+  return key_range <= 4 * expected_keys ? Backend::Dense : Backend::Sparse;
+}
 
-  if (not use_threads)
+std::size_t
+    estimateDistinctTerms(Ensemble const &ensemble, int order)
+{
+  auto const &summary = ensemble.summary;
+  auto const  A       = static_cast<std::uint64_t>(summary.D + 1);
+  auto const  tuples  = combinations(summary.L, order);
+  auto const  samples = std::min<std::uint64_t>(tuples, 64);
+  if (samples == 0)
+    return 0;
+
+  std::vector<int> all_positions(summary.L);
+  std::iota(std::begin(all_positions), std::end(all_positions), 0);
+  std::vector<int> positions;
+  std::mt19937     gen;   // fixed seed, so that estimates are reproducible
+
+  auto const N = ensemble.sequences.size();
+
+  HashTable                  seen;
+  std::vector<std::uint64_t> keys;
+  std::uint64_t              distinct = 0;
+  for (std::uint64_t s = 0; s < samples; ++s)
   {
-    pwm.clear();   // map has to be empty
-    for (auto const &sequence : ensemble.sequences)
+    positions.clear();
+    std::sample(std::begin(all_positions),
+                std::end(all_positions),
+                std::back_inserter(positions),
+                order,
+                gen);
+    seen.clear();
+    keys.assign(N, 0);
+    for (auto const p : positions)
     {
-      for (int i = 0; i < L; ++i)
-        for (int j = i + 1; j < L; ++j)
-          for (int k = j + 1; k < L; ++k)
-            pwm[{ i,
-                  j,
-                  k,
-                  sequence.sequence[i],
-                  sequence.sequence[j],
-                  sequence.sequence[k] }] += sequence.weight;
+      auto const column = ensemble.column(p);
+      for (std::size_t n = 0; n < N; ++n)
+        keys[n] = keys[n] * A + column[n];
     }
+    for (auto const key : keys)
+      seen[key];
+    distinct += seen.size();
+  }
+  return static_cast<std::size_t>(static_cast<long double>(distinct) /
+                                  samples * tuples);
+}
+
+// per-tuple sums of the weights of every symbol combination, so that a
+// table sees each distinct term once per tuple
+class TupleSums
+{
+private:
+  std::vector<double>        sums;
+  std::vector<std::uint8_t>  seen;
+  std::vector<std::uint64_t> touched;
+
+public:
+  // combinations above this are added to tables directly
+  static constexpr std::uint64_t max_combinations = std::uint64_t{ 1 } << 20;
+
+  explicit TupleSums(std::uint64_t combinations)
+      : sums(combinations, 0.0), seen(combinations, 0)
+  {
+  }
 
-    for (auto &[key, val] : pwm)
+  void
+      add(std::uint64_t code, double weight)
+  {
+    if (not seen[code])
     {
-      val /= ensemble.summary.total_weight;
+      seen[code] = 1;
+      touched.push_back(code);
     }
+    sums[code] += weight;
   }
-  else
+
+  // adds every sum to the table at base + code, and starts over
+  void
+      flush(TermTable &table, std::uint64_t base)
   {
+    for (auto const code : touched)
+    {
+      table.add(base + code, sums[code]);
+      sums[code] = 0.0;
+      seen[code] = 0;
+    }
+    touched.clear();
+  }
+};
+
+// sums tables[1..] into tables[0], merging pairs of tables in parallel in
+// rounds of a binary tree; the merged tables are left empty
+void
+    mergeTree(std::vector<TermTable> &tables, ThreadPool &pool)
+{
+  for (std::size_t step = 1; step < tables.size(); step *= 2)
+    pool.parallelFor((tables.size() + 2 * step - 1) / (2 * step),
+                     [&](std::size_t p, unsigned)
+                     {
+                       auto const a = 2 * step * p;
+                       auto const b = a + step;
+                       if (b >= tables.size())
+                         return;
+                       tables[a].merge(tables[b]);
+                       tables[b] = TermTable{};
+                     });
+}
+
+PWM_3::PWM_3(Ensemble const          &ensemble,
+             ThreadPool              &pool,
+             Backend                  backend,
+             std::size_t              memory_budget,
+             double                   c,
+             bool,
+             CooccurrenceIndex const *index)
+    : summary(ensemble.summary), ranks(ensemble.summary.L)
+{
+  ensemble.verify();
+  checkKeyRange(summary, 3);
+  auto const L  = summary.L;
+  auto const A  = static_cast<std::uint64_t>(summary.D + 1);
+  auto const A3 = A * A * A;
+
+  auto const triples  = combinations(L, 3);
+  auto const expected = estimateDistinctTerms(ensemble, 3);
+  auto const range    = triples * A3;
+  pwm = TermTable{
+    resolveBackend(backend, range, expected), range, expected, memory_budget
+  };
+
+  auto const N = ensemble.sequences.size();
+  auto const w = ensemble.weights.data();
+
+  // workers write disjoint ranges of a dense table, so they can share it;
+  // other tables are private to each worker and merged afterwards
+  auto const shared = pwm.isDense() or pool.size() == 1;
+  auto const partial_backend =
+      pwm.isExternal() ? Backend::External : Backend::Sparse;
+  std::vector<TermTable> partial(shared ? 0 : pool.size());
+  for (auto &table : partial)
+    table = TermTable{ partial_backend,
+                       range,
+                       expected / pool.size(),
+                       memory_budget / pool.size() };
+
+  auto const aggregate =
+      not pwm.isDense() and A3 <= TupleSums::max_combinations;
+  // the prototype alone is as large as every combination of symbols
+  std::vector<TupleSums> sums;
+  if (aggregate)
+    sums.assign(pool.size(), TupleSums{ A3 });
+
+  // every pair (i, j) is a task that counts the triples (i, j, k)
+  auto const pairs = allPairs(L);
+  pool.parallelFor(
+      pairs.size(),
+      [&](std::size_t p, unsigned worker)
+      {
+        auto const [i, j] = pairs[p];
+        if (j == L - 1)
+          return;   // no triples continue past the last position
+        auto &table = shared ? pwm : partial[worker];
 
-    pwm_t = std::vector(
-        L, std::map<std::tuple<int, int, char, char, char>, double>{});
+        auto const column_i = ensemble.column(i);
+        auto const column_j = ensemble.column(j);
 
-    std::vector<std::thread> v;
-    for (int i = 0; i < L; ++i)
-      v.emplace_back(
-          [&, i_t = i]
+        auto t = tripleIndex(i, j, j + 1, L);
+        for (int k = j + 1; k < L; ++k, ++t)
+        {
+          if (index and index->pays(i, j, k))
+          {
+            index->forEachTriple(
+                i,
+                j,
+                k,
+                [&](std::uint8_t code_i,
+                    std::uint8_t code_j,
+                    std::uint8_t code_k,
+                    double       count) {
+                  table.add(t * A3 + (code_i * A + code_j) * A + code_k,
+                            count);
+                });
+            continue;
+          }
+          auto const column_k = ensemble.column(k);
+          if (aggregate)
           {
-            for (auto const &sequence : ensemble.sequences)
-              for (int j = i_t + 1; j < L; ++j)
-                for (int k = j + 1; k < L; ++k)
-                  pwm_t[i_t][{ j,
-                               k,
-                               sequence.sequence[i_t],
-                               sequence.sequence[j],
-                               sequence.sequence[k] }] += sequence.weight;
-
-            for (auto &[key, val] : pwm_t[i_t])
-              val /= ensemble.summary.total_weight;
-          });
+            for (std::size_t n = 0; n < N; ++n)
+              sums[worker].add(
+                  (column_i[n] * A + column_j[n]) * A + column_k[n], w[n]);
+            sums[worker].flush(table, t * A3);
+            continue;
+          }
+          for (std::size_t n = 0; n < N; ++n)
+            table.add(t * A3 + (column_i[n] * A + column_j[n]) * A +
+                          column_k[n],
+                      w[n]);
+        }
+      });
 
-    for (int i = 0; i < L; ++i)
-      v[i].join();
+  if (not shared)
+  {
+    mergeTree(partial, pool);
+    pwm = std::move(partial[0]);
   }
+
+  auto const D = summary.D;
+  pwm.transform(
+      [&](double val)
+      {
+        return std::log(D * D * D * (val / ensemble.summary.total_weight + c)) /
+               std::log(D);
+      });
 }
 
-PWM_4::PWM_4(Ensemble const &ensemble, bool use_threads)
-    : summary(ensemble.summary)
+PWM_4::PWM_4(Ensemble const &ensemble,
+             ThreadPool     &pool,
+             Backend         backend,
+             std::size_t     memory_budget,
+             double          c,
+             bool)
+    : summary(ensemble.summary), ranks(ensemble.summary.L)
 {
   ensemble.verify();
-  auto const L = summary.L;
-  if (not use_threads)
+  checkKeyRange(summary, 4);
+  auto const L  = summary.L;
+  auto const A  = static_cast<std::uint64_t>(summary.D + 1);
+  auto const A4 = A * A * A * A;
+
+  auto const quads    = combinations(L, 4);
+  auto const expected = estimateDistinctTerms(ensemble, 4);
+  auto const range    = quads * A4;
+  pwm = TermTable{
+    resolveBackend(backend, range, expected), range, expected, memory_budget
+  };
+
+  auto const N = ensemble.sequences.size();
+  auto const w = ensemble.weights.data();
+
+  std::vector<std::tuple<int, int, int>> triples;
+  for (int i = 0; i < L; ++i)
+    for (int j = i + 1; j < L; ++j)
+      for (int k = j + 1; k < L - 1; ++k)
+        triples.emplace_back(i, j, k);
+
+  auto const aggregate =
+      not pwm.isDense() and A4 <= TupleSums::max_combinations;
+  std::vector<TupleSums> sums;
+  if (aggregate)
+    sums.assign(pool.size(), TupleSums{ A4 });
+
+  // counts the quadruples (i, j, k, l) of the sequences [begin, end)
+  auto const count_from = [&](TermTable  &table,
+                              unsigned    worker,
+                              int         i,
+                              int         j,
+                              int         k,
+                              std::size_t begin,
+                              std::size_t end)
   {
-    pwm.clear();   // map has to be empty
-    for (auto const &sequence : ensemble.sequences)
-    {
-      for (int i = 0; i < L; ++i)
-        for (int j = i + 1; j < L; ++j)
-          for (int k = j + 1; k < L; ++k)
-            for (int l = k + 1; l < L; ++l)
-              pwm[{ i,
-                    j,
-                    k,
-                    l,
-                    sequence.sequence[i],
-                    sequence.sequence[j],
-                    sequence.sequence[k],
-                    sequence.sequence[l] }] += sequence.weight;
-    }
+    auto const column_i = ensemble.column(i);
+    auto const column_j = ensemble.column(j);
+    auto const column_k = ensemble.column(k);
 
-    for (auto &[key, val] : pwm)
+    auto t = quadIndex(i, j, k, k + 1, L);
+    for (int l = k + 1; l < L; ++l, ++t)
     {
-      val /= ensemble.summary.total_weight;
+      auto const column_l = ensemble.column(l);
+      if (aggregate)
+      {
+        for (auto n = begin; n < end; ++n)
+          sums[worker].add(
+              ((column_i[n] * A + column_j[n]) * A + column_k[n]) * A +
+                  column_l[n],
+              w[n]);
+        sums[worker].flush(table, t * A4);
+        continue;
+      }
+      for (auto n = begin; n < end; ++n)
+        table.add(t * A4 +
+                      ((column_i[n] * A + column_j[n]) * A + column_k[n]) * A +
+                      column_l[n],
+                  w[n]);
     }
+  };
+
+  if (pwm.isDense() or pool.size() == 1)
+  {
+    // workers write disjoint ranges of the table, so they can share it
+    pool.parallelFor(triples.size(),
+                     [&](std::size_t p, unsigned worker)
+                     {
+                       auto const [i, j, k] = triples[p];
+                       count_from(pwm, worker, i, j, k, 0, N);
+                     });
   }
   else
   {
-    std::cout << "Generating PWMs of order 4 with threads not implemented. "
-                 "PWMS of this size are not expected to fit in memory.\n";
-    throw EnsembleError{};
+    // every worker counts a shard of the sequences into a private table
+    auto const shards = pool.size();
+    auto const partial_backend =
+        pwm.isExternal() ? Backend::External : Backend::Sparse;
+    // twice a shard's share of the terms, as shards overlap
+    auto const reserved = std::min(expected, 2 * expected / shards);
+    std::vector<TermTable> partial(shards);
+    pool.parallelFor(shards,
+                     [&](std::size_t s, unsigned worker)
+                     {
+                       partial[s] = TermTable{ partial_backend,
+                                               range,
+                                               reserved,
+                                               memory_budget / shards };
+                       for (auto const &[i, j, k] : triples)
+                         count_from(partial[s],
+                                    worker,
+                                    i,
+                                    j,
+                                    k,
+                                    N * s / shards,
+                                    N * (s + 1) / shards);
+                     });
+    mergeTree(partial, pool);
+    pwm = std::move(partial[0]);
   }
+
+  auto const D = summary.D;
+  pwm.transform(
+      [&](double val)
+      {
+        return std::log(D * D * D * (val / ensemble.summary.total_weight + c)) /
+               std::log(D);
+      });
 }
 
 double
-    PWM_1::evaluate(std::string const &sequence,
-                    bool               use_threads,
-                    double             c,
-                    bool               use_bias) const
+    PWM_1::evaluate(std::vector<std::uint8_t> const &sequence) const
 {
   auto const L     = summary.L;
-  auto const D     = summary.D;
+  auto const A     = summary.D + 1;
   auto       score = 0.;
   for (int i = 0; i < L; ++i)
-  {
-    if (use_threads)
-    {
-      auto val = pwm_t[i].find(sequence[i]);
+    score += pwm[i * A + sequence[i]];
+  return score;
+}
 
-      score += std::log(D * ((val != pwm_t[i].end() ? val->second : 0.) + c)) /
-               std::log(D);
-    }
-    else
-    {
-      auto val = pwm.find({ i, sequence[i] });
+double
+    PWM_2::evaluate(std::vector<std::uint8_t> const &sequence) const
+{
+  auto const L     = summary.L;
+  auto const A     = static_cast<std::size_t>(summary.D + 1);
+  auto       score = 0.;
+  auto       p     = pwm.begin();
+  for (int i = 0; i < L; ++i)
+    for (int j = i + 1; j < L; ++j, p += A * A)
+      score += p[sequence[i] * A + sequence[j]];
+  return score;
+}
 
-      auto const biased_D =
-          use_bias ? static_cast<double>(summary.N * summary.L) /
-                         summary.symbol_counts.at(sequence[i]).first
-                   : D;
+double
+    PWM_3::evaluate(std::vector<std::uint8_t> const &sequence) const
+{
+  auto const L  = summary.L;
+  auto const A  = static_cast<std::uint64_t>(summary.D + 1);
+  auto const A3 = A * A * A;
 
-      score +=
-          std::log(biased_D * ((val != pwm.end() ? val->second : 0.) + c)) /
-          std::log(D);
-    }
-  }
+  auto          score = 0.;
+  std::uint64_t t     = 0;
+  for (int i = 0; i < L; ++i)
+    for (int j = i + 1; j < L; ++j)
+      for (int k = j + 1; k < L; ++k, ++t)
+        score += pwm.find(t * A3 + (sequence[i] * A + sequence[j]) * A +
+                          sequence[k]);
   return score;
 }
 
 double
-    PWM_2::evaluate(std::string const &sequence,
-                    bool               use_threads,
-                    double             c,
-                    bool               use_bias) const
+    PWM_4::evaluate(std::vector<std::uint8_t> const &sequence) const
 {
-  auto const L     = summary.L;
-  auto const D     = summary.D;
-  auto       score = 0.;
+  auto const L  = summary.L;
+  auto const A  = static_cast<std::uint64_t>(summary.D + 1);
+  auto const A4 = A * A * A * A;
+
+  auto          score = 0.;
+  std::uint64_t t     = 0;
   for (int i = 0; i < L; ++i)
     for (int j = i + 1; j < L; ++j)
-    {
-      if (use_threads)
-      {
-        auto val = pwm_t[i].find({ j, sequence[i], sequence[j] });
+      for (int k = j + 1; k < L; ++k)
+        for (int l = k + 1; l < L; ++l, ++t)
+          score += pwm.find(
+              t * A4 +
+              ((sequence[i] * A + sequence[j]) * A + sequence[k]) * A +
+              sequence[l]);
+  return score;
+}
 
-        score +=
-            std::log(D * D * ((val != pwm_t[i].end() ? val->second : 0.) + c)) /
-            std::log(D);
-      }
-      else
+// sequences scored together by the batched evaluates, few enough that their
+// codes and scores stay in cache while a table is walked once for them all
+constexpr std::size_t evaluate_block = 1024;
+
+// calls f(first, n, columns) for blocks of n sequences from first, with
+// columns[i * n + s] the code at position i of sequence first + s
+template <typename F>
+void
+    forEachBlock(std::vector<std::vector<std::uint8_t>> const &sequences,
+                 int                                           L,
+                 F                                           &&f)
+{
+  std::vector<std::uint8_t> columns;
+  for (std::size_t first = 0; first < sequences.size(); first += evaluate_block)
+  {
+    auto const n = std::min(evaluate_block, sequences.size() - first);
+    columns.resize(L * n);
+    for (std::size_t s = 0; s < n; ++s)
+      for (int i = 0; i < L; ++i)
+        columns[i * n + s] = sequences[first + s][i];
+    f(first, n, columns.data());
+  }
+}
+
+std::vector<double>
+    PWM_1::evaluate(
+        std::vector<std::vector<std::uint8_t>> const &sequences) const
+{
+  auto const L = summary.L;
+  auto const A = static_cast<std::size_t>(summary.D + 1);
+
+  std::vector<double>        scores(sequences.size(), 0.0);
+  std::vector<std::uint32_t> keys(evaluate_block);
+  forEachBlock(sequences,
+               L,
+               [&](std::size_t first, std::size_t n, std::uint8_t const *codes)
+               {
+                 for (int i = 0; i < L; ++i)
+                 {
+                   auto const column = codes + i * n;
+                   std::copy(column, column + n, std::begin(keys));
+                   gatherAdd(scores.data() + first,
+                             pwm.data() + i * A,
+                             keys.data(),
+                             n);
+                 }
+               });
+  return scores;
+}
+
+std::vector<double>
+    PWM_2::evaluate(
+        std::vector<std::vector<std::uint8_t>> const &sequences) const
+{
+  auto const L = summary.L;
+  auto const A = static_cast<std::size_t>(summary.D + 1);
+
+  std::vector<double>        scores(sequences.size(), 0.0);
+  std::vector<std::uint32_t> keys(evaluate_block);
+  forEachBlock(sequences,
+               L,
+               [&](std::size_t first, std::size_t n, std::uint8_t const *codes)
+               {
+                 auto p = pwm.data();
+                 for (int i = 0; i < L; ++i)
+                   for (int j = i + 1; j < L; ++j, p += A * A)
+                   {
+                     auto const column_i = codes + i * n;
+                     auto const column_j = codes + j * n;
+                     for (std::size_t s = 0; s < n; ++s)
+                       keys[s] = column_i[s] * A + column_j[s];
+                     gatherAdd(scores.data() + first, p, keys.data(), n);
+                   }
+               });
+  return scores;
+}
+
+std::vector<double>
+    PWM_3::evaluate(
+        std::vector<std::vector<std::uint8_t>> const &sequences) const
+{
+  auto const L  = summary.L;
+  auto const A  = static_cast<std::uint64_t>(summary.D + 1);
+  auto const A3 = A * A * A;
+
+  std::vector<double> scores(sequences.size(), 0.0);
+  forEachBlock(sequences,
+               L,
+               [&](std::size_t first, std::size_t n, std::uint8_t const *codes)
+               {
+                 auto const    block = scores.data() + first;
+                 std::uint64_t t     = 0;
+                 for (int i = 0; i < L; ++i)
+                   for (int j = i + 1; j < L; ++j)
+                     for (int k = j + 1; k < L; ++k, ++t)
+                     {
+                       auto const column_i = codes + i * n;
+                       auto const column_j = codes + j * n;
+                       auto const column_k = codes + k * n;
+                       for (std::size_t s = 0; s < n; ++s)
+                         block[s] += pwm.find(
+                             t * A3 + (column_i[s] * A + column_j[s]) * A +
+                             column_k[s]);
+                     }
+               });
+  return scores;
+}
+
+std::vector<double>
+    PWM_4::evaluate(
+        std::vector<std::vector<std::uint8_t>> const &sequences) const
+{
+  auto const L  = summary.L;
+  auto const A  = static_cast<std::uint64_t>(summary.D + 1);
+  auto const A4 = A * A * A * A;
+
+  std::vector<double> scores(sequences.size(), 0.0);
+  forEachBlock(
+      sequences,
+      L,
+      [&](std::size_t first, std::size_t n, std::uint8_t const *codes)
       {
-        auto val = pwm.find({ i, j, sequence[i], sequence[j] });
+        auto const    block = scores.data() + first;
+        std::uint64_t t     = 0;
+        for (int i = 0; i < L; ++i)
+          for (int j = i + 1; j < L; ++j)
+            for (int k = j + 1; k < L; ++k)
+              for (int l = k + 1; l < L; ++l, ++t)
+              {
+                auto const column_i = codes + i * n;
+                auto const column_j = codes + j * n;
+                auto const column_k = codes + k * n;
+                auto const column_l = codes + l * n;
+                for (std::size_t s = 0; s < n; ++s)
+                  block[s] += pwm.find(
+                      t * A4 +
+                      ((column_i[s] * A + column_j[s]) * A + column_k[s]) * A +
+                      column_l[s]);
+              }
+      });
+  return scores;
+}
 
-        auto const biased_D_i =
-            use_bias ? static_cast<double>(summary.N * summary.L) /
-                           summary.symbol_counts.at(sequence[i]).first
-                     : D;
+// x, whose elements but the last are increasing, with the last moved into
+// place
+template <std::size_t n>
+std::array<int, n>
+    placeLast(std::array<int, n> x)
+{
+  for (auto s = n - 1; s > 0 and x[s - 1] > x[s]; --s)
+    std::swap(x[s - 1], x[s]);
+  return x;
+}
 
-        auto const biased_D_j =
-            use_bias ? static_cast<double>(summary.N * summary.L) /
-                           summary.symbol_counts.at(sequence[j]).first
-                     : D;
+std::vector<double>
+    PWM_1::termSums(std::vector<std::uint8_t> const &sequence) const
+{
+  auto const          L = summary.L;
+  auto const          A = summary.D + 1;
+  std::vector<double> sums(L);
+  for (int i = 0; i < L; ++i)
+    sums[i] = pwm[i * A + sequence[i]];
+  return sums;
+}
 
-        score += std::log(biased_D_i * biased_D_j *
-                          ((val != pwm.end() ? val->second : 0.) + c)) /
-                 std::log(D);
-      }
+std::vector<double>
+    PWM_2::termSums(std::vector<std::uint8_t> const &sequence) const
+{
+  auto const          L = summary.L;
+  auto const          A = static_cast<std::size_t>(summary.D + 1);
+  std::vector<double> sums(L, 0.0);
+  auto                p = pwm.begin();
+  for (int i = 0; i < L; ++i)
+    for (int j = i + 1; j < L; ++j, p += A * A)
+    {
+      auto const term = p[sequence[i] * A + sequence[j]];
+      sums[i] += term;
+      sums[j] += term;
     }
-  return score;
+  return sums;
 }
 
-double
-    PWM_3::evaluate(std::string const &sequence,
-                    bool               use_threads,
-                    double             c,
-                    bool) const
+std::vector<double>
+    PWM_3::termSums(std::vector<std::uint8_t> const &sequence) const
 {
-  auto const L     = summary.L;
-  auto const D     = summary.D;
-  auto       score = 0.;
+  auto const L  = summary.L;
+  auto const A  = static_cast<std::uint64_t>(summary.D + 1);
+  auto const A3 = A * A * A;
+
+  std::vector<double> sums(L, 0.0);
+  std::uint64_t       t = 0;
   for (int i = 0; i < L; ++i)
     for (int j = i + 1; j < L; ++j)
-      for (int k = j + 1; k < L; ++k)
+      for (int k = j + 1; k < L; ++k, ++t)
       {
-        if (use_threads)
-        {
-          auto val =
-              pwm_t[i].find({ j, k, sequence[i], sequence[j], sequence[k] });
+        auto const term = pwm.find(
+            t * A3 + (sequence[i] * A + sequence[j]) * A + sequence[k]);
+        sums[i] += term;
+        sums[j] += term;
+        sums[k] += term;
+      }
+  return sums;
+}
 
-          score += std::log(D * D * D *
-                            ((val != pwm_t[i].end() ? val->second : 0.) + c)) /
-                   std::log(D);
-        }
-        else
-        {
-          auto val =
-              pwm.find({ i, j, k, sequence[i], sequence[j], sequence[k] });
+std::vector<double>
+    PWM_4::termSums(std::vector<std::uint8_t> const &sequence) const
+{
+  auto const L  = summary.L;
+  auto const A  = static_cast<std::uint64_t>(summary.D + 1);
+  auto const A4 = A * A * A * A;
 
-          score += std::log(D * D * D *
-                            ((val != pwm.end() ? val->second : 0.) + c)) /
-                   std::log(D);
+  std::vector<double> sums(L, 0.0);
+  std::uint64_t       t = 0;
+  for (int i = 0; i < L; ++i)
+    for (int j = i + 1; j < L; ++j)
+      for (int k = j + 1; k < L; ++k)
+        for (int l = k + 1; l < L; ++l, ++t)
+        {
+          auto const term = pwm.find(
+              t * A4 +
+              ((sequence[i] * A + sequence[j]) * A + sequence[k]) * A +
+              sequence[l]);
+          sums[i] += term;
+          sums[j] += term;
+          sums[k] += term;
+          sums[l] += term;
         }
-      }
-  return score;
+  return sums;
+}
+
+// terms touching several changed positions are visited once, from the
+// first of them
+
+double
+    PWM_1::delta(std::vector<std::uint8_t> const &from,
+                 std::vector<std::uint8_t> const &to,
+                 std::vector<int> const          &changed,
+                 std::vector<double> const &) const
+{
+  auto const A     = summary.D + 1;
+  auto       delta = 0.;
+  for (auto const p : changed)
+    delta += pwm[p * A + to[p]] - pwm[p * A + from[p]];
+  return delta;
+}
+
+double
+    PWM_2::delta(std::vector<std::uint8_t> const &from,
+                 std::vector<std::uint8_t> const &to,
+                 std::vector<int> const          &changed,
+                 std::vector<double> const       &from_sums) const
+{
+  auto const L      = summary.L;
+  auto const A      = static_cast<std::size_t>(summary.D + 1);
+  auto const single = changed.size() == 1;
+
+  auto delta = 0.;
+  for (auto const p : changed)
+    for (int q = 0; q < L; ++q)
+    {
+      if (q == p or (q < p and from[q] != to[q]))
+        continue;
+      auto const [i, j] = std::minmax(p, q);
+      auto const terms  = pwm.data() + pairIndex(i, j, L) * A * A;
+      delta += terms[to[i] * A + to[j]];
+      if (not single)
+        delta -= terms[from[i] * A + from[j]];
+    }
+  return single ? delta - from_sums[changed[0]] : delta;
 }
 
 double
-    PWM_4::evaluate(std::string const &sequence,
-                    bool               use_threads,
-                    double             c,
-                    bool) const
+    PWM_3::delta(std::vector<std::uint8_t> const &from,
+                 std::vector<std::uint8_t> const &to,
+                 std::vector<int> const          &changed,
+                 std::vector<double> const       &from_sums) const
 {
-  if (use_threads)
+  auto const L      = summary.L;
+  auto const A      = static_cast<std::uint64_t>(summary.D + 1);
+  auto const A3     = A * A * A;
+  auto const single = changed.size() == 1;
+  auto const key    = [&](std::vector<std::uint8_t> const &codes,
+                       std::array<int, 3> const        &x)
+  { return (codes[x[0]] * A + codes[x[1]]) * A + codes[x[2]]; };
+
+  auto delta = 0.;
+  for (auto const p : changed)
   {
-    std::cout << "Error: Can't evaluate with order 4 PWM.\n";
-    throw EnsembleError{};
+    auto const visited = [&](int q)
+    { return q != p and (q > p or from[q] == to[q]); };
+    for (int q = 0; q < L; ++q)
+    {
+      if (not visited(q))
+        continue;
+      for (int r = q + 1; r < L; ++r)
+      {
+        if (not visited(r))
+          continue;
+        auto const x    = placeLast<3>({ q, r, p });
+        auto const base = ranks.triple(x[0], x[1], x[2]) * A3;
+        delta += pwm.find(base + key(to, x));
+        if (not single)
+          delta -= pwm.find(base + key(from, x));
+      }
+    }
   }
-  auto const L     = summary.L;
-  auto const D     = summary.D;
-  auto       score = 0.;
-  for (int i = 0; i < L; ++i)
-    for (int j = i + 1; j < L; ++j)
-      for (int k = j + 1; k < L; ++k)
-        for (int l = k + 1; l < L; ++l)
+  return single ? delta - from_sums[changed[0]] : delta;
+}
+
+double
+    PWM_4::delta(std::vector<std::uint8_t> const &from,
+                 std::vector<std::uint8_t> const &to,
+                 std::vector<int> const          &changed,
+                 std::vector<double> const       &from_sums) const
+{
+  auto const L      = summary.L;
+  auto const A      = static_cast<std::uint64_t>(summary.D + 1);
+  auto const A4     = A * A * A * A;
+  auto const single = changed.size() == 1;
+  auto const key    = [&](std::vector<std::uint8_t> const &codes,
+                       std::array<int, 4> const        &x)
+  {
+    return ((codes[x[0]] * A + codes[x[1]]) * A + codes[x[2]]) * A +
+           codes[x[3]];
+  };
+
+  auto delta = 0.;
+  for (auto const p : changed)
+  {
+    auto const visited = [&](int q)
+    { return q != p and (q > p or from[q] == to[q]); };
+    for (int q = 0; q < L; ++q)
+    {
+      if (not visited(q))
+        continue;
+      for (int r = q + 1; r < L; ++r)
+      {
+        if (not visited(r))
+          continue;
+        for (int u = r + 1; u < L; ++u)
         {
-          auto val = pwm.find({ i,
-                                j,
-                                k,
-                                l,
-                                sequence[i],
-                                sequence[j],
-                                sequence[l],
-                                sequence[k] });
-
-          score += std::log(D * D * D *
-                            ((val != pwm.end() ? val->second : 0.) + c)) /
-                   std::log(D);
+          if (not visited(u))
+            continue;
+          auto const x    = placeLast<4>({ q, r, u, p });
+          auto const base = ranks.quad(x[0], x[1], x[2], x[3]) * A4;
+          delta += pwm.find(base + key(to, x));
+          if (not single)
+            delta -= pwm.find(base + key(from, x));
         }
-  return score;
+      }
+    }
+  }
+  return single ? delta - from_sums[changed[0]] : delta;
 }
 
-std::tuple<PWM_1, PWM_2, PWM_3, PWM_4>
-    generatePWMs(Ensemble const &ensemble, int order, bool use_threads)
+// peak bytes of a HashTable growing to n keys, whose last rehash holds both
+// the old entries and the new ones
+long double
+    hashTableBytes(long double n)
 {
-  switch (order)
+  long double capacity = 16;
+  while (capacity < 2 * n)
+    capacity *= 2;
+  return (capacity + capacity / 2) * 2 * sizeof(std::uint64_t);
+}
+
+// bytes of physical memory, or no bound where it cannot be queried
+std::size_t
+    physicalMemory()
+{
+  auto const pages = sysconf(_SC_PHYS_PAGES);
+  auto const page  = sysconf(_SC_PAGE_SIZE);
+  if (pages <= 0 or page <= 0)
+    return std::numeric_limits<std::size_t>::max();
+  return static_cast<std::size_t>(pages) * static_cast<std::size_t>(page);
+}
+
+char const *
+    backendName(Backend backend)
+{
+  switch (backend)
   {
-    case 1:
-      return { PWM_1{ ensemble, use_threads }, {}, {}, {} };
-    case 2:
-      return {
-        PWM_1{ ensemble, use_threads }, PWM_2{ ensemble, use_threads }, {}, {}
-      };
-    case 3:
-      return { PWM_1{ ensemble, use_threads },
-               PWM_2{ ensemble, use_threads },
-               PWM_3{ ensemble, use_threads },
-               {} };
-    case 4:
-      return { PWM_1{ ensemble, use_threads },
-               PWM_2{ ensemble, use_threads },
-               PWM_3{ ensemble, use_threads },
-               PWM_4{ ensemble, use_threads } };
+    case Backend::Dense:
+      return "dense";
+    case Backend::Sparse:
+      return "sparse";
+    case Backend::External:
+      return "external";
     default:
-      std::cout << "Error: PWM order must be between 1 and 4\n";
-      throw EnsembleError{};
+      return "auto";
   }
 }
 
+MemoryPlan::MemoryPlan(Ensemble const &ensemble,
+                       int             order,
+                       unsigned        threads,
+                       Backend         backend,
+                       CountEngine     engine,
+                       std::size_t     max_memory)
+    : order(order), threads(std::max(1u, threads)), max_memory(max_memory)
+{
+  ensemble.verify();
+  auto const &summary = ensemble.summary;
+  auto const  L       = static_cast<long double>(summary.L);
+  auto const  A       = static_cast<long double>(summary.D + 1);
+  auto const  N       = static_cast<long double>(ensemble.sequences.size());
+  auto const  T       = static_cast<long double>(this->threads);
+
+  // in long double, as estimates can exceed the address space
+  auto const saturate = [](long double b)
+  {
+    auto const most = std::numeric_limits<std::size_t>::max();
+    return b >= static_cast<long double>(most) ? most
+                                               : static_cast<std::size_t>(b);
+  };
+  auto const mib = [](std::size_t b) { return b >> 20; };
+
+  // without a limit, PWMs are still kept within physical memory, so that a
+  // table that cannot fit fails here rather than part way through building it
+  auto const limit = max_memory ? max_memory : physicalMemory();
+  auto const describe = [&]
+  {
+    std::ostringstream text;
+    if (max_memory)
+      text << "the memory limit of " << mib(max_memory) << " MiB";
+    else
+      text << "the " << mib(limit) << " MiB of physical memory";
+    return text.str();
+  };
+
+  backends.fill(Backend::Dense);
+  budgets.fill(external_budget);
+  bytes[1] = saturate(L * A * sizeof(double));
+  if (order > 1)
+    bytes[2] = saturate(pairCount(summary.L) * A * A * sizeof(double));
+  if (engine == CountEngine::Bitset and order > 1)
+  {
+    std::set<double> classes(std::begin(ensemble.weights),
+                             std::end(ensemble.weights));
+    index = saturate(L * A * (std::ceil(N / 64) + classes.size()) *
+                     sizeof(std::uint64_t));
+  }
+  for (int k = 3; k <= order; ++k)
+  {
+    checkKeyRange(summary, k);
+    terms[k] = estimateDistinctTerms(ensemble, k);
+  }
+
+  struct Estimate
+  {
+    std::size_t bytes;
+    std::size_t disk;
+    std::size_t budget;
+  };
+  // of building the table of order k with backend b in at most available
+  // bytes, which an external table sizes its buffer to
+  auto const estimate = [&](int k, Backend b, std::size_t available)
+  {
+    auto const tuples   = static_cast<long double>(combinations(summary.L, k));
+    auto const symbols  = std::pow(A, k);
+    auto const expected = static_cast<long double>(terms[k]);
+    if (b == Backend::Dense)
+      return Estimate{
+        saturate(tuples * symbols * sizeof(double)), 0, external_budget
+      };
+
+    // terms a worker holds before the merge: pairs of positions partition
+    // the order 3 terms, but every sequence shard of order 4 may see them all
+    auto const shard = T == 1   ? expected
+                       : k == 3 ? expected / T
+                                : std::min(expected, tuples * std::ceil(N / T));
+    auto const scratch =
+        symbols <= TupleSums::max_combinations
+            ? T * symbols * (sizeof(double) + sizeof(std::uint8_t))
+            : 0.0L;
+    if (b == Backend::Sparse)
+      return Estimate{ saturate(hashTableBytes(expected) +
+                                (T > 1 ? T * hashTableBytes(shard) : 0) +
+                                scratch),
+                       0,
+                       external_budget };
+
+    // a buffer of B bytes costs B + spill / B with the merge's read buffers
+    long double const record  = sizeof(ExternalTable::Record);
+    auto const        io      = ExternalTable::io_records * record;
+    auto const        records = (T == 1 ? expected : T * shard) * record;
+    auto const        spill   = records * T * io;
+    auto const        room    = available - scratch - io;   // for rounding
+    auto              buffer  = std::sqrt(spill);
+    if (room * room >= 4 * spill)
+      buffer = (room + std::sqrt(room * room - 4 * spill)) / 2;
+    buffer = std::max(T * io, std::min<long double>(external_budget, buffer));
+    return Estimate{
+      saturate(std::min(buffer, records) +
+               std::ceil(records * T / buffer) * io + scratch),
+      saturate(records + expected * record),
+      saturate(buffer)
+    };
+  };
+
+  // the backends tried for the table of order k, fastest first
+  auto const candidates = [&](int k)
+  {
+    auto const range = combinations(summary.L, k) *
+                       static_cast<std::uint64_t>(std::pow(A, k));
+    auto const resolved = resolveBackend(backend, range, terms[k]);
+    std::vector<Backend> tried{ resolved };
+    if (backend == Backend::Auto)
+      for (auto const b :
+           { Backend::Dense, Backend::Sparse, Backend::External })
+        if (b != resolved)
+          tried.push_back(b);
+    return tried;
+  };
+
+  // the first backend tried for the table of order k that is estimated to
+  // fit in available bytes; throws naming the last one tried if none does
+  auto const fit = [&](int k, std::size_t available, std::size_t later)
+  {
+    auto const tried = candidates(k);
+    for (auto const b : tried)
+      if (estimate(k, b, available).bytes <= available)
+        return b;
+    std::cout << "Error: the order " << k << " PWM needs an estimated "
+              << mib(estimate(k, tried.back(), available).bytes)
+              << " MiB with the " << backendName(tried.back())
+              << " backend, but " << describe() << " leaves "
+              << mib(available) << " MiB for it";
+    if (later)
+      std::cout << " after the " << mib(later)
+                << " MiB the higher orders need at least";
+    std::cout << "\n";
+    throw EnsembleError{};
+  };
+
+  auto used = bytes[1] + bytes[2] + index;
+  if (used > limit)
+  {
+    std::cout << "Error: the PWMs of orders 1 and 2 need an estimated "
+              << mib(used) << " MiB, more than " << describe() << "\n";
+    throw EnsembleError{};
+  }
+  // an order that cannot fit even on its own is the one reported, rather
+  // than a lower order it leaves no room for
+  for (int k = 3; k <= order; ++k)
+    fit(k, limit - used, 0);
+  for (int k = 3; k <= order; ++k)
+  {
+    // the least the tables of the later orders can be built in
+    std::size_t later = 0;
+    for (int m = k + 1; m <= order; ++m)
+    {
+      auto least = std::numeric_limits<std::size_t>::max();
+      for (auto const b : candidates(m))
+        least = std::min(least, estimate(m, b, 0).bytes);
+      later = saturate(static_cast<long double>(later) + least);
+    }
+    auto const needed    = saturate(static_cast<long double>(used) + later);
+    auto const available = limit > needed ? limit - needed : 0;
+
+    auto const chosen_backend = fit(k, available, later);
+    auto const chosen         = estimate(k, chosen_backend, available);
+    backends[k]               = chosen_backend;
+    bytes[k]                  = chosen.bytes;
+    disk[k]                   = chosen.disk;
+    budgets[k]                = chosen.budget;
+    used += chosen.bytes;
+  }
+}
+
+void
+    MemoryPlan::print() const
+{
+  auto const mib = [](std::size_t b) { return b / double(1 << 20); };
+  auto const flags = std::cout.flags();
+  auto const precision = std::cout.precision();
+  std::cout << std::fixed << std::setprecision(1);
+
+  std::cout << "\n------\nMemory plan for PWMs of order " << order
+            << "\n------\n";
+  std::cout << "Memory limit: ";
+  if (max_memory)
+    std::cout << mib(max_memory) << " MiB\n";
+  else
+    std::cout << "none\n";
+  auto total = index;
+  for (int k = 1; k <= order; ++k)
+  {
+    std::cout << "Order " << k << ": " << std::setw(10) << mib(bytes[k])
+              << " MiB, " << backendName(backends[k]);
+    if (k > 2)
+      std::cout << ", ~" << terms[k] << " distinct terms";
+    if (backends[k] == Backend::External)
+      std::cout << ", " << mib(budgets[k]) << " MiB buffered, "
+                << mib(disk[k]) << " MiB on disk";
+    std::cout << "\n";
+    total += bytes[k];
+  }
+  if (index)
+    std::cout << "Bitset index: " << mib(index) << " MiB\n";
+  std::cout << "Total (estimated peak, " << threads
+            << " threads): " << mib(total) << " MiB" << std::endl;
+
+  std::cout.flags(flags);
+  std::cout.precision(precision);
+}
+
+std::tuple<PWM_1, PWM_2, PWM_3, PWM_4>
+    generatePWMs(Ensemble const   &ensemble,
+                 int               order,
+                 ThreadPool       &pool,
+                 MemoryPlan const &plan,
+                 CountEngine       engine,
+                 double            c,
+                 bool              use_bias)
+{
+  std::unique_ptr<CooccurrenceIndex> index;
+  if (engine == CountEngine::Bitset and order > 1)
+    index = std::make_unique<CooccurrenceIndex>(ensemble);
+  auto const idx = index.get();
+
+  if (order < 1 or order > 4)
+  {
+    std::cout << "Error: PWM order must be between 1 and 4\n";
+    throw EnsembleError{};
+  }
+
+  // the plan's estimates can still fall short, so running out of memory
+  // names the table that did not fit
+  auto const build = [&](int k, auto construct)
+  {
+    try
+    {
+      return construct();
+    }
+    catch (std::bad_alloc const &)
+    {
+      std::cout << "Error: out of memory building the order " << k
+                << " PWM with the " << backendName(plan.backend(k))
+                << " backend\n";
+      throw EnsembleError{};
+    }
+  };
+
+  std::tuple<PWM_1, PWM_2, PWM_3, PWM_4> pwms;
+  std::get<0>(pwms) =
+      build(1, [&] { return PWM_1{ ensemble, pool, c, use_bias }; });
+  if (order > 1)
+    std::get<1>(pwms) =
+        build(2, [&] { return PWM_2{ ensemble, pool, c, use_bias, idx }; });
+  if (order > 2)
+    std::get<2>(pwms) = build(3,
+                              [&]
+                              {
+                                return PWM_3{ ensemble,
+                                              pool,
+                                              plan.backend(3),
+                                              plan.externalBudget(3),
+                                              c,
+                                              use_bias,
+                                              idx };
+                              });
+  if (order > 3)
+    std::get<3>(pwms) = build(4,
+                              [&]
+                              {
+                                return PWM_4{ ensemble,
+                                              pool,
+                                              plan.backend(4),
+                                              plan.externalBudget(4),
+                                              c,
+                                              use_bias };
+                              });
+  return pwms;
+}
+
 std::tuple<int, char, bool>
-    checkValidMutation(std::string const      &mutation,
+    checkValidMutation(std::string_view        mutation,
                        std::string const      &true_wild_type,
                        std::vector<int> const &valid_positions,
                        int                     true_offset,
                        std::ofstream          &fails)
 {
-  bool        valid_mutation = true;
-  std::regex  r{ R"((\w)(\d+)(\w))" };
-  std::smatch m;
-  if (not std::regex_match(mutation, m, r))
+  // a wild-type residue, its position and the replacing residue, as the
+  // pattern (\w)(\d+)(\w) would match them
+  auto const word = [](char c)
+  { return std::isalnum(static_cast<unsigned char>(c)) or c == '_'; };
+  auto const digit = [](char c)
+  { return std::isdigit(static_cast<unsigned char>(c)) != 0; };
+  int  position = 0;
+  bool matched  = false;
+  if (mutation.size() >= 3 and word(mutation.front()) and word(mutation.back()))
+  {
+    auto const first = mutation.data() + 1;
+    auto const last  = mutation.data() + mutation.size() - 1;
+    matched          = std::all_of(first, last, digit) and
+                       std::from_chars(first, last, position).ec == std::errc{};
+  }
+  if (not matched)
   {
     std::cout << "Error: Not able to match " << mutation << "\n";
     throw EnsembleError{};
   }
 
-  auto index = std::stoi(m[2].str()) - true_offset;
+  bool valid_mutation = true;
+  auto index          = position - true_offset;
 
   if (index >= static_cast<int>(true_wild_type.length()) or index < 0)
   {
     fails << "Skipping: Can't test mutation at position " << index + 1
           << " when target only contains " << true_wild_type.length()
           << " positions" << std::endl;
-    valid_mutation = false;
+    return { index, mutation.back(), false };
   }
 
-  if (true_wild_type[index] != m[1].str()[0])
+  if (true_wild_type[index] != mutation.front())
   {
     fails << "Target sequence does not work for " << mutation
           << ", target sequences contains '" << true_wild_type[index]
@@ -413,55 +1278,75 @@ std::tuple<int, char, bool>
   {
     index = valid_positions[index];
   }
-  return { index, m[3].str()[0], valid_mutation };
+  return { index, mutation.back(), valid_mutation };
 }
 
-std::vector<Mutant>
+Mutants
     generateMutants(std::string const      &train_file,
                     std::string const      &true_wild_type,
                     std::vector<int> const &valid_positions,
                     int                     true_offset,
+                    Ensemble const         &ensemble,
                     std::ofstream          &fails)
 {
-  std::vector<Mutant> mutants;
+  Mutants mutants;
 
-  std::ifstream ifs{ train_file };
-  if (not ifs.is_open())
+  // parsed in place; a compressed file is inflated into memory first
+  MappedFile const file{ train_file };
+  std::string      inflated;
+  auto             text = file.text();
+  if (isGzipped(text))
   {
-    std::cout << "Error: file " << train_file << " not found";
-    throw EnsembleError{};
+    inflated = inflate(text, train_file);
+    text     = inflated;
   }
 
-  std::string line;
-  while (std::getline(ifs, line))
+  for (std::size_t begin = 0; begin < text.size();)
   {
-    if (line[0] == '#')   // skip comments
+    auto end = text.find('\n', begin);
+    if (end == std::string_view::npos)
+      end = text.size();
+    auto const line = text.substr(begin, end - begin);
+    begin           = end + 1;
+
+    if (not line.empty() and line[0] == '#')   // skip comments
       continue;
-    auto col = line.substr(0, line.find(';'));
+    auto const col = line.substr(0, line.find(';'));
     if (col == "mutant")   // skip header
       continue;
-    Mutant mutant;
-    mutant.valid_mutation = true;
-    mutant.descriptor     = col;
-    if (col != "WT" and col != "wt")
-    {
-      auto const mutations = split(col, ',');
-      for (auto const &mutation : mutations)
-      {
-        auto const [position, replacement, valid_mutation] = checkValidMutation(
-            mutation, true_wild_type, valid_positions, true_offset, fails);
+    mutants.add(col);
+    if (col == "WT" or col == "wt")
+      continue;
 
-        mutant.valid_mutation &= valid_mutation;
-        mutant.mutations.push_back({ position, replacement });
-      }
+    // comma separated, where a trailing comma ends the list
+    for (std::size_t first = 0; first < col.size();)
+    {
+      auto last = col.find(',', first);
+      if (last == std::string_view::npos)
+        last = col.size();
+      auto const [position, replacement, valid_mutation] =
+          checkValidMutation(col.substr(first, last - first),
+                             true_wild_type,
+                             valid_positions,
+                             true_offset,
+                             fails);
+      mutants.addMutation({ position, ensemble.encode(replacement) },
+                          valid_mutation);
+      first = last + 1;
     }
-    mutants.push_back(mutant);
   }
   return mutants;
 }
 
-WT_PWM_1::WT_PWM_1(Ensemble const &ensemble, double c, bool use_bias)
-    : summary(ensemble.summary)
+WT_PWM_1::WT_PWM_1(Ensemble const                     &ensemble,
+                   double                              c,
+                   bool                                use_bias,
+                   std::shared_ptr<ResidueIndex const> residues)
+    : summary(ensemble.summary), pseudo_count(c),
+      biased_D(biasedD(ensemble.summary, use_bias)),
+      residues(std::move(residues)),
+      cache(std::make_unique<SubstitutionCache>(ensemble.summary.L,
+                                                ensemble.summary.D + 1))
 {
   wt_score = 0.0;
 
@@ -469,73 +1354,61 @@ WT_PWM_1::WT_PWM_1(Ensemble const &ensemble, double c, bool use_bias)
   auto const L = ensemble.summary.L;
   auto const D = ensemble.summary.D;
 
-  auto const wild_type = ensemble.sequences[0].sequence;
+  auto const wild_type = ensemble.sequences[0].codes;
 
-  wt_pwm.clear();
+  wt_terms.assign(L, 0.0);
   for (auto const &sequence : ensemble.sequences)
     for (int i = 0; i < L; ++i)
-      if (sequence.sequence[i] == wild_type[i])
-        wt_pwm[{ i, wild_type[i] }] +=
-            sequence.weight / ensemble.summary.total_weight;
+      if (sequence.codes[i] == wild_type[i])
+        wt_terms[i] += sequence.weight / ensemble.summary.total_weight;
 
   for (int i = 0; i < L; ++i)
   {
-    if (summary.symbol_counts.find(wild_type[i]) == summary.symbol_counts.end())
-    {
-      std::cout << "err: " << wild_type[i] << "not found\n";
-      ensemble.print_summary();
-    }
-    auto const biased_D = use_bias
-                              ? static_cast<double>(summary.N * summary.L) /
-                                    summary.symbol_counts.at(wild_type[i]).first
-                              : D;
-
-    wt_score +=
-        std::log(biased_D * (wt_pwm[{ i, wild_type[i] }] + c)) / std::log(D);
+    wt_terms[i] = std::log(biased_D[wild_type[i]] *
+                           (wt_terms[i] + c)) /
+                  std::log(D);
+    wt_score += wt_terms[i];
   }
 }
 
 double
-    WT_PWM_1::evaluate(Ensemble const &ensemble,
-                       Mutant const   &mutant,
-                       double          c,
-                       bool            use_bias) const
+    WT_PWM_1::substitution(Ensemble const &ensemble,
+                           int             pos,
+                           std::uint8_t    rep) const
 {
   auto const D = ensemble.summary.D;
 
-  auto const wild_type = ensemble.sequences[0].sequence;
-
-  auto score = wt_score;
-
-  for (auto const &[pos, rep] : mutant.mutations)
-  {
-    auto const wild_type_biased_D =
-        use_bias ? static_cast<double>(summary.N * summary.L) /
-                       summary.symbol_counts.at(wild_type[pos]).first
-                 : D;
-
-    score -= std::log(wild_type_biased_D *
-                      (wt_pwm.at({ pos, wild_type[pos] }) + c)) /
-             std::log(D);
+  auto delta = -wt_terms[pos];
 
-    auto combo_score = 0.0;
-    for (auto const &sequence : ensemble.sequences)
-      if (sequence.sequence[pos] == rep)
-        combo_score += sequence.weight / ensemble.summary.total_weight;
+  auto combo_score = 0.0;
+  for (auto const n : residues->sequences(pos, rep))
+    combo_score += ensemble.sequences[n].weight / ensemble.summary.total_weight;
 
-    auto const biased_D = use_bias
-                              ? static_cast<double>(summary.N * summary.L) /
-                                    summary.symbol_counts.at(rep).first
-                              : D;
+  delta += std::log(biased_D[rep] * (combo_score + pseudo_count)) / std::log(D);
 
-    score += std::log(biased_D * (combo_score + c)) / std::log(D);
-  }
+  return delta;
+}
 
+double
+    WT_PWM_1::evaluate(Ensemble const &ensemble, Mutant const &mutant) const
+{
+  auto score = wt_score;
+  for (auto const &[pos, rep] : mutant.mutations)
+    score += cache->delta(
+        pos, rep, [&] { return substitution(ensemble, pos, rep); });
   return score;
 }
 
-WT_PWM_2::WT_PWM_2(Ensemble const &ensemble, double c, bool use_bias)
-    : summary(ensemble.summary)
+WT_PWM_2::WT_PWM_2(Ensemble const                          &ensemble,
+                   double                                   c,
+                   bool                                     use_bias,
+                   std::shared_ptr<CooccurrenceIndex const> index,
+                   std::shared_ptr<ResidueIndex const>      residues)
+    : summary(ensemble.summary), pseudo_count(c),
+      biased_D(biasedD(ensemble.summary, use_bias)), index(std::move(index)),
+      residues(std::move(residues)),
+      cache(std::make_unique<SubstitutionCache>(ensemble.summary.L,
+                                                ensemble.summary.D + 1))
 {
   wt_score = 0.0;
 
@@ -543,101 +1416,98 @@ WT_PWM_2::WT_PWM_2(Ensemble const &ensemble, double c, bool use_bias)
   auto const L = ensemble.summary.L;
   auto const D = ensemble.summary.D;
 
-  auto const wild_type = ensemble.sequences[0].sequence;
+  auto const wild_type = ensemble.sequences[0].codes;
 
-  wt_pwm.clear();
-  for (auto const &sequence : ensemble.sequences)
+  wt_terms.assign(pairCount(L), 0.0);
+  if (this->index)
+  {
+    auto term = wt_terms.begin();
     for (int i = 0; i < L; ++i)
-      for (int j = i + 1; j < L; ++j)
-        if (sequence.sequence[i] == wild_type[i] and
-            sequence.sequence[j] == wild_type[j])
-          wt_pwm[{ i, j, wild_type[i], wild_type[j] }] +=
-              sequence.weight / ensemble.summary.total_weight;
+      for (int j = i + 1; j < L; ++j, ++term)
+        *term = this->index->count(i, wild_type[i], j, wild_type[j]) /
+                ensemble.summary.total_weight;
+  }
+  else
+    for (auto const &sequence : ensemble.sequences)
+      for (int i = 0; i < L; ++i)
+        if (sequence.codes[i] == wild_type[i])
+          for (int j = i + 1; j < L; ++j)
+            if (sequence.codes[j] == wild_type[j])
+              wt_terms[pairIndex(i, j, L)] +=
+                  sequence.weight / ensemble.summary.total_weight;
 
+  auto term = wt_terms.begin();
   for (int i = 0; i < L; ++i)
-    for (int j = i + 1; j < L; ++j)
+    for (int j = i + 1; j < L; ++j, ++term)
     {
-      auto const biased_D_i =
-          use_bias ? static_cast<double>(summary.N * summary.L) /
-                         summary.symbol_counts.at(wild_type[i]).first
-                   : D;
-
-      auto const biased_D_j =
-          use_bias ? static_cast<double>(summary.N * summary.L) /
-                         summary.symbol_counts.at(wild_type[j]).first
-                   : D;
-
-      wt_score += std::log(biased_D_i * biased_D_j *
-                           (wt_pwm[{ i, j, wild_type[i], wild_type[j] }] + c)) /
-                  std::log(D);
+      *term = std::log(biased_D[wild_type[i]] *
+                       biased_D[wild_type[j]] * (*term + c)) /
+              std::log(D);
+      wt_score += *term;
     }
 }
 
 double
-    WT_PWM_2::evaluate(Ensemble const &ensemble,
-                       Mutant const   &mutant,
-                       double          c,
-                       bool            use_bias) const
+    WT_PWM_2::substitution(Ensemble const &ensemble,
+                           int             pos,
+                           std::uint8_t    rep) const
 {
   auto const D = ensemble.summary.D;
   auto const L = ensemble.summary.L;
 
-  auto const wild_type = ensemble.sequences[0].sequence;
-
-  auto score = wt_score;
+  auto const &wild_type = ensemble.sequences[0].codes;
 
-  for (auto const &[pos, rep] : mutant.mutations)
-  {
-    for (int i = 0; i < L; ++i)
-      for (int j = i + 1; j < L; ++j)
-        if (i == pos or j == pos)
-        {
-          auto const wild_type_biased_D_i =
-              use_bias ? static_cast<double>(summary.N * summary.L) /
-                             summary.symbol_counts.at(wild_type[i]).first
-                       : D;
-
-          auto const wild_type_biased_D_j =
-              use_bias ? static_cast<double>(summary.N * summary.L) /
-                             summary.symbol_counts.at(wild_type[j]).first
-                       : D;
-          score -=
-              std::log(wild_type_biased_D_i * wild_type_biased_D_j *
-                       (wt_pwm.at({ i, j, wild_type[i], wild_type[j] }) + c)) /
-              std::log(D);
-        }
+  auto delta = 0.0;
+  for (int i = 0; i < pos; ++i)
+    delta -= wt_terms[pairIndex(i, pos, L)];
+  for (int j = pos + 1; j < L; ++j)
+    delta -= wt_terms[pairIndex(pos, j, L)];
 
-    std::vector<double> adjusted_scores(L, 0.0);
+  std::vector<double> adjusted_scores(L, 0.0);
 
-    for (auto const &sequence : ensemble.sequences)
+  if (index)
+    for (int i = 0; i < L; ++i)
+      adjusted_scores[i] = index->count(i, wild_type[i], pos, rep) /
+                           ensemble.summary.total_weight;
+  else
+    for (auto const n : residues->sequences(pos, rep))
+    {
+      auto const &sequence = ensemble.sequences[n];
       for (int i = 0; i < L; ++i)
-        if (i != pos and sequence.sequence[i] == wild_type[i] and
-            sequence.sequence[pos] == rep)
+        if (i != pos and sequence.codes[i] == wild_type[i])
           adjusted_scores[i] += sequence.weight / ensemble.summary.total_weight;
+    }
 
-    for (int i = 0; i < L; ++i)
-      if (i != pos)
-      {
-        auto const biased_D_i =
-            use_bias ? static_cast<double>(summary.N * summary.L) /
-                           summary.symbol_counts.at(wild_type[i]).first
-                     : D;
-
-        auto const biased_D_rep =
-            use_bias ? static_cast<double>(summary.N * summary.L) /
-                           summary.symbol_counts.at(rep).first
-                     : D;
-        score +=
-            std::log(biased_D_i * biased_D_rep * (adjusted_scores[i] + c)) /
-            std::log(D);
-      }
-  }
+  auto const biased_D_rep = biased_D[rep];
+  for (int i = 0; i < L; ++i)
+    if (i != pos)
+      delta += std::log(biased_D[wild_type[i]] * biased_D_rep *
+                        (adjusted_scores[i] + pseudo_count)) /
+               std::log(D);
+
+  return delta;
+}
 
+double
+    WT_PWM_2::evaluate(Ensemble const &ensemble, Mutant const &mutant) const
+{
+  auto score = wt_score;
+  for (auto const &[pos, rep] : mutant.mutations)
+    score += cache->delta(
+        pos, rep, [&] { return substitution(ensemble, pos, rep); });
   return score;
 }
 
-WT_PWM_3::WT_PWM_3(Ensemble const &ensemble, double c, bool)
-    : summary(ensemble.summary)
+WT_PWM_3::WT_PWM_3(Ensemble const                          &ensemble,
+                   double                                   c,
+                   bool,
+                   Backend                                  backend,
+                   std::shared_ptr<CooccurrenceIndex const> index,
+                   std::shared_ptr<ResidueIndex const>      residues)
+    : summary(ensemble.summary), pseudo_count(c), index(std::move(index)),
+      residues(std::move(residues)),
+      cache(std::make_unique<SubstitutionCache>(ensemble.summary.L,
+                                                ensemble.summary.D + 1))
 {
   wt_score = 0.0;
 
@@ -645,81 +1515,346 @@ WT_PWM_3::WT_PWM_3(Ensemble const &ensemble, double c, bool)
   auto const L = ensemble.summary.L;
   auto const D = ensemble.summary.D;
 
-  auto const wild_type = ensemble.sequences[0].sequence;
+  auto const wild_type = ensemble.sequences[0].codes;
 
-  wt_pwm.clear();
-  for (auto const &sequence : ensemble.sequences)
+  // every triple is matched at least by the wild type itself, so there is
+  // nothing for a sparse table to leave out unless explicitly asked for
+  auto const triples = combinations(L, 3);
+  wt_pwm             = TermTable{
+    backend == Backend::Sparse ? Backend::Sparse : Backend::Dense,
+    triples,
+    triples
+  };
+
+  if (this->index)
+  {
+    std::uint64_t t = 0;
     for (int i = 0; i < L; ++i)
       for (int j = i + 1; j < L; ++j)
-        for (int k = j + 1; k < L; ++k)
-          if (sequence.sequence[i] == wild_type[i] and
-              sequence.sequence[j] == wild_type[j] and
-              sequence.sequence[k] == wild_type[k])
-            wt_pwm[{ i, j, k, wild_type[i], wild_type[j], wild_type[k] }] +=
-                sequence.weight / ensemble.summary.total_weight;
+        for (int k = j + 1; k < L; ++k, ++t)
+          wt_pwm[t] = this->index->count(
+                          i, wild_type[i], j, wild_type[j], k, wild_type[k]) /
+                      ensemble.summary.total_weight;
+  }
+  else
+    for (auto const &sequence : ensemble.sequences)
+    {
+      std::uint64_t t = 0;
+      for (int i = 0; i < L; ++i)
+      {
+        if (sequence.codes[i] != wild_type[i])
+        {
+          t += combinations(L - i - 1, 2);
+          continue;
+        }
+        for (int j = i + 1; j < L; ++j)
+        {
+          if (sequence.codes[j] != wild_type[j])
+          {
+            t += L - j - 1;
+            continue;
+          }
+          for (int k = j + 1; k < L; ++k, ++t)
+            if (sequence.codes[k] == wild_type[k])
+              wt_pwm[t] += sequence.weight / ensemble.summary.total_weight;
+        }
+      }
+    }
 
-  for (int i = 0; i < L; ++i)
-    for (int j = i + 1; j < L; ++j)
-      for (int k = j + 1; k < L; ++k)
-        wt_score +=
-            std::log(
-                D * D * D *
-                (wt_pwm[{ i, j, k, wild_type[i], wild_type[j], wild_type[k] }] +
-                 c)) /
-            std::log(D);
+  wt_pwm.transform([&](double val)
+                   { return std::log(D * D * D * (val + c)) / std::log(D); });
+  for (std::uint64_t t = 0; t < triples; ++t)
+    wt_score += wt_pwm.find(t);
 }
 
 double
-    WT_PWM_3::evaluate(Ensemble const &ensemble,
-                       Mutant const   &mutant,
-                       double          c,
-                       bool) const
+    WT_PWM_3::substitution(Ensemble const &ensemble,
+                           int             pos,
+                           std::uint8_t    rep) const
 {
   auto const D = ensemble.summary.D;
   auto const L = ensemble.summary.L;
 
-  auto const wild_type = ensemble.sequences[0].sequence;
+  auto const &wild_type = ensemble.sequences[0].codes;
 
-  auto score = wt_score;
+  // the wild type's triples through pos, in lexicographic order
+  auto delta = 0.0;
+  for (int i = 0; i < pos; ++i)
+  {
+    for (int j = i + 1; j < pos; ++j)
+      delta -= wt_pwm.find(tripleIndex(i, j, pos, L));
+    for (int k = pos + 1; k < L; ++k)
+      delta -= wt_pwm.find(tripleIndex(i, pos, k, L));
+  }
+  for (int j = pos + 1; j < L; ++j)
+    for (int k = j + 1; k < L; ++k)
+      delta -= wt_pwm.find(tripleIndex(pos, j, k, L));
 
-  for (auto const &[pos, rep] : mutant.mutations)
+  std::vector<std::vector<double>> adjusted_scores(L,
+                                                   std::vector<double>(L, 0.0));
+
+  if (index)
   {
     for (int i = 0; i < L; ++i)
       for (int j = i + 1; j < L; ++j)
-        for (int k = j + 1; k < L; ++k)
-          if (i == pos or j == pos or k == pos)
-            score -= std::log(D * D * D *
-                              (wt_pwm.at({ i,
-                                           j,
-                                           k,
-                                           wild_type[i],
-                                           wild_type[j],
-                                           wild_type[k] }) +
-                               c)) /
-                     std::log(D);
-
-    std::vector<std::vector<double>> adjusted_scores(
-        L, std::vector<double>(L, 0.0));
-
-    for (auto const &sequence : ensemble.sequences)
+        if (i != pos and j != pos)
+          adjusted_scores[i][j] =
+              index->count(i, wild_type[i], j, wild_type[j], pos, rep) /
+              ensemble.summary.total_weight;
+  }
+  else
+    for (auto const n : residues->sequences(pos, rep))
+    {
+      auto const &sequence = ensemble.sequences[n];
       for (int i = 0; i < L; ++i)
+      {
+        if (i == pos or sequence.codes[i] != wild_type[i])
+          continue;
         for (int j = i + 1; j < L; ++j)
-          if (i != pos and j != pos and sequence.sequence[i] == wild_type[i] and
-              sequence.sequence[j] == wild_type[j] and
-              sequence.sequence[pos] == rep)
+          if (j != pos and sequence.codes[j] == wild_type[j])
             adjusted_scores[i][j] +=
                 sequence.weight / ensemble.summary.total_weight;
+      }
+    }
 
-    for (int i = 0; i < L; ++i)
+  for (int i = 0; i < L; ++i)
+    for (int j = i + 1; j < L; ++j)
+      if (i != pos and j != pos)
+        delta += std::log(D * D * D * (adjusted_scores[i][j] + pseudo_count)) /
+                 std::log(D);
+
+  return delta;
+}
+
+double
+    WT_PWM_3::evaluate(Ensemble const &ensemble, Mutant const &mutant) const
+{
+  auto score = wt_score;
+  for (auto const &[pos, rep] : mutant.mutations)
+    score += cache->delta(
+        pos, rep, [&] { return substitution(ensemble, pos, rep); });
+  return score;
+}
+
+WT_PWM_4::WT_PWM_4(Ensemble const                     &ensemble,
+                   ThreadPool                         &pool,
+                   double                              c,
+                   bool,
+                   std::shared_ptr<ResidueIndex const> residues)
+    : summary(ensemble.summary), pseudo_count(c),
+      residues(std::move(residues)),
+      cache(std::make_unique<SubstitutionCache>(ensemble.summary.L,
+                                                ensemble.summary.D + 1))
+{
+  ensemble.verify();
+  auto const L = ensemble.summary.L;
+  auto const D = ensemble.summary.D;
+
+  auto const &wild_type = ensemble.sequences[0].codes;
+
+  // counted a first pair of positions (i, j) at a time, over the sequences
+  // with the wild type at both, into a block per worker keyed by the rank of
+  // (k, l) after j, and folded into per position sums; a worker's scratch is
+  // O(N + L^2) rather than O(L^3), and i is interleaved as work shrinks with i
+  struct Scratch
+  {
+    std::vector<std::uint32_t> at_j;
+    std::vector<double>        block;
+  };
+  std::vector<double> fractions(ensemble.sequences.size());
+  for (std::size_t n = 0; n < fractions.size(); ++n)
+    fractions[n] = ensemble.weights[n] / ensemble.summary.total_weight;
+  auto const                       workers = pool.size();
+  std::vector<Scratch>             scratch(workers);
+  std::vector<std::vector<double>> sums(L, std::vector<double>(L, 0.0));
+  std::vector<double>              totals(L, 0.0);
+  auto const                       per_worker = (L + workers - 1) / workers;
+  pool.parallelFor(
+      std::size_t(per_worker) * workers,
+      [&](std::size_t task, unsigned worker)
+      {
+        auto const i = int(task % per_worker * workers + task / per_worker);
+        if (i >= L)
+          return;
+        auto &[at_j, block] = scratch[worker];
+        auto      &sum      = sums[i];
+        auto const at_i     = this->residues->sequences(i, wild_type[i]);
+        for (int j = i + 1; j < L; ++j)
+        {
+          auto const column_j = ensemble.column(j);
+          at_j.clear();
+          for (auto const n : at_i)
+            if (column_j[n] == wild_type[j])
+              at_j.push_back(n);
+
+          block.assign(combinations(L - j - 1, 2), 0.0);
+          for (auto const n : at_j)
+          {
+            auto const    codes    = ensemble.sequences[n].codes.data();
+            auto const    fraction = fractions[n];
+            std::uint64_t t        = 0;
+            for (int k = j + 1; k < L; ++k)
+            {
+              if (codes[k] != wild_type[k])
+              {
+                t += L - k - 1;
+                continue;
+              }
+              for (int l = k + 1; l < L; ++l, ++t)
+                block[t] += codes[l] == wild_type[l] ? fraction : 0.0;
+            }
+          }
+
+          std::uint64_t t = 0;
+          for (int k = j + 1; k < L; ++k)
+            for (int l = k + 1; l < L; ++l, ++t)
+            {
+              // D^3 rather than D^4, as in PWM_4, so that both score
+              // single mutants alike
+              auto const term =
+                  std::log(D * D * D * (block[t] + c)) / std::log(D);
+              totals[i] += term;
+              sum[i] += term;
+              sum[j] += term;
+              sum[k] += term;
+              sum[l] += term;
+            }
+        }
+      });
+
+  wt_score = 0.0;
+  wt_sums.assign(L, 0.0);
+  for (int i = 0; i < L; ++i)
+  {
+    wt_score += totals[i];
+    for (int p = 0; p < L; ++p)
+      wt_sums[p] += sums[i][p];
+  }
+}
+
+double
+    WT_PWM_4::substitution(Ensemble const &ensemble,
+                           int             pos,
+                           std::uint8_t    rep) const
+{
+  auto const D = ensemble.summary.D;
+  auto const L = ensemble.summary.L;
+
+  auto const &wild_type = ensemble.sequences[0].codes;
+
+  auto delta = -wt_sums[pos];
+
+  // weighted counts of the wild type's triples among the sequences with rep
+  // at pos, a first position i at a time over those with the wild type at i,
+  // keyed by the rank of (j, k) after i; kept per thread across calls, and
+  // O(N + L^2) rather than O(L^3)
+  thread_local std::vector<std::uint32_t> at_i;
+  thread_local std::vector<double>        block;
+  // the wild type but for pos, where every sequence counted has rep instead,
+  // so that the counting loops need not branch on pos
+  thread_local std::vector<std::uint8_t> wild;
+  wild      = wild_type;
+  wild[pos] = static_cast<std::uint8_t>(rep ^ 1);
+
+  // most triples never occur with a rare symbol, and all share this score
+  auto const unseen = std::log(D * D * D * pseudo_count) / std::log(D);
+  auto const at_pos = residues->sequences(pos, rep);
+  for (int i = 0; i < L; ++i)
+  {
+    if (i == pos)
+      continue;
+    auto const column_i = ensemble.column(i);
+    at_i.clear();
+    for (auto const n : at_pos)
+      if (column_i[n] == wild_type[i])
+        at_i.push_back(n);
+
+    block.assign(combinations(L - i - 1, 2), 0.0);
+    for (auto const n : at_i)
+    {
+      auto const codes = ensemble.sequences[n].codes.data();
+      auto const fraction =
+          ensemble.weights[n] / ensemble.summary.total_weight;
+      std::uint64_t t = 0;
       for (int j = i + 1; j < L; ++j)
-        if (i != pos and j != pos)
-          score +=
-              std::log(D * D * D * (adjusted_scores[i][j] + c)) / std::log(D);
+      {
+        if (codes[j] != wild[j])
+        {
+          t += L - j - 1;
+          continue;
+        }
+        for (int k = j + 1; k < L; ++k, ++t)
+          block[t] += codes[k] == wild[k] ? fraction : 0.0;
+      }
+    }
+
+    std::uint64_t t = 0;
+    for (int j = i + 1; j < L; ++j)
+      for (int k = j + 1; k < L; ++k, ++t)
+        if (j != pos and k != pos)
+          delta += block[t] == 0.0
+                       ? unseen
+                       : std::log(D * D * D * (block[t] + pseudo_count)) /
+                             std::log(D);
   }
 
+  return delta;
+}
+
+double
+    WT_PWM_4::evaluate(Ensemble const &ensemble, Mutant const &mutant) const
+{
+  auto score = wt_score;
+  for (auto const &[pos, rep] : mutant.mutations)
+    score += cache->delta(
+        pos, rep, [&] { return substitution(ensemble, pos, rep); });
   return score;
 }
 
+void
+    SubstitutionCache::print(std::string const &name) const
+{
+  auto const hit     = hits.load();
+  auto const lookups = hit + misses.load();
+  std::cout << name << " substitution cache: " << hit << " hits in " << lookups
+            << " lookups";
+  if (lookups)
+    std::cout << " (" << std::round(1000.0 * hit / lookups) / 10 << "%)";
+  std::cout << "\n";
+}
+
+// mutants scored together by one task of the pool
+constexpr std::size_t mutant_chunk = 1024;
+
+// writes the rows of mutants [0, mutants) to ofs in order, with chunks
+// formatted on the workers by write_rows(first, last, out)
+template <typename WriteRows>
+void
+    writeInOrder(std::ofstream &ofs,
+                 std::size_t    mutants,
+                 ThreadPool    &pool,
+                 WriteRows    &&write_rows)
+{
+  auto const               chunks = (mutants + mutant_chunk - 1) / mutant_chunk;
+  auto const               wave   = std::size_t{ 4 } * pool.size();
+  std::vector<std::string> buffers(wave);
+  for (std::size_t first = 0; first < chunks; first += wave)
+  {
+    auto const count = std::min(wave, chunks - first);
+    pool.parallelFor(count,
+                     [&](std::size_t c, unsigned)
+                     {
+                       auto const begin = (first + c) * mutant_chunk;
+                       auto const end = std::min(mutants, begin + mutant_chunk);
+                       std::ostringstream out;
+                       write_rows(begin, end, out);
+                       buffers[c] = out.str();
+                     });
+    for (std::size_t c = 0; c < count; ++c)
+      ofs << buffers[c];
+  }
+}
+
 void
     testA2MWithoutPWMs(std::string const &out_file_name,
                        std::string const &train_file,
@@ -727,9 +1862,11 @@ void
                        Ensemble const    &ensemble,
                        int                order,
                        int                true_offset,
-                       bool,
-                       double c,
-                       bool   use_bias)
+                       ThreadPool        &pool,
+                       double             c,
+                       bool               use_bias,
+                       Backend            backend,
+                       CountEngine        engine)
 {
   assert(order < 5 and order > 0);
   std::ofstream ofs{ out_file_name + ".scores" };
@@ -765,66 +1902,94 @@ void
                   std::end(wild_type));
 
   std::ofstream fails{ out_file_name + ".fails" };
-  auto const   &mutants = generateMutants(
-      train_file, true_wild_type, valid_positions, true_offset, fails);
+  auto const   &mutants = generateMutants(train_file,
+                                         true_wild_type,
+                                         valid_positions,
+                                         true_offset,
+                                         ensemble,
+                                         fails);
+
+  std::shared_ptr<CooccurrenceIndex const> index;
+  if (engine == CountEngine::Bitset and order > 1)
+    index = std::make_shared<CooccurrenceIndex const>(ensemble);
 
-  auto const wt_pwm_1 = WT_PWM_1{ ensemble, c, use_bias };
+  auto const residues = std::make_shared<ResidueIndex const>(ensemble);
+
+  auto const wt_pwm_1 = WT_PWM_1{ ensemble, c, use_bias, residues };
   WT_PWM_2   wt_pwm_2;
   if (order > 1)
-    wt_pwm_2 = WT_PWM_2{ ensemble, c, use_bias };
+    wt_pwm_2 = WT_PWM_2{ ensemble, c, use_bias, index, residues };
   WT_PWM_3 wt_pwm_3;
   if (order > 2)
-    wt_pwm_3 = WT_PWM_3{ ensemble, c, use_bias };
+    wt_pwm_3 = WT_PWM_3{ ensemble, c, use_bias, backend, index, residues };
+  WT_PWM_4 wt_pwm_4;
+  if (order > 3)
+    wt_pwm_4 = WT_PWM_4{ ensemble, pool, c, use_bias, residues };
 
-  for (auto const &mutant : mutants)
+  auto const write_rows =
+      [&](std::size_t first, std::size_t last, std::ostream &out)
   {
-    ofs << mutant.descriptor;
-    switch (order)
+    for (auto m = first; m < last; ++m)
     {
-        /*
-      case 4:
-        if (not mutant.valid_mutation)
-          ofs << ";";
-        else
-           ofs << ";" << std::get<3>(pwms).evaluate(sequence, use_threads);
-        [[fallthrough]];
-          */
-      case 3:
-        if (not mutant.valid_mutation)
-          ofs << ";";
-        else
-          // ofs << ";" << std::get<2>(pwms).evaluate(sequence, use_threads);
-          ofs << ";" << wt_pwm_3.evaluate(ensemble, mutant, c, use_bias);
-        [[fallthrough]];
-      case 2:
-        if (not mutant.valid_mutation)
-          ofs << ";";
-        else
-          // ofs << ";" << std::get<1>(pwms).evaluate(sequence, use_threads);
-          ofs << ";" << wt_pwm_2.evaluate(ensemble, mutant, c, use_bias);
-        [[fallthrough]];
-      case 1:
-        if (not mutant.valid_mutation)
-          ofs << ";";
-        else
-          //  ofs << ";" << std::get<0>(pwms).evaluate(sequence, use_threads);
-          ofs << ";" << wt_pwm_1.evaluate(ensemble, mutant, c, use_bias);
+      auto const &mutant = mutants[m];
+      out << mutant.descriptor;
+      switch (order)
+      {
+        case 4:
+          if (not mutant.valid_mutation)
+            out << ";";
+          else
+            out << ";" << wt_pwm_4.evaluate(ensemble, mutant);
+          [[fallthrough]];
+        case 3:
+          if (not mutant.valid_mutation)
+            out << ";";
+          else
+            out << ";" << wt_pwm_3.evaluate(ensemble, mutant);
+          [[fallthrough]];
+        case 2:
+          if (not mutant.valid_mutation)
+            out << ";";
+          else
+            out << ";" << wt_pwm_2.evaluate(ensemble, mutant);
+          [[fallthrough]];
+        case 1:
+          if (not mutant.valid_mutation)
+            out << ";";
+          else
+            out << ";" << wt_pwm_1.evaluate(ensemble, mutant);
+      }
+      out << "\n";
     }
-    ofs << "\n";
-  }
+  };
+  writeInOrder(ofs, mutants.size(), pool, write_rows);
   std::cout << "All test sequences are scored.\n" << std::flush;
+
+  switch (order)
+  {
+    case 4:
+      wt_pwm_4.substitutions().print("order 4");
+      [[fallthrough]];
+    case 3:
+      wt_pwm_3.substitutions().print("order 3");
+      [[fallthrough]];
+    case 2:
+      wt_pwm_2.substitutions().print("order 2");
+      [[fallthrough]];
+    case 1:
+      wt_pwm_1.substitutions().print("order 1");
+  }
 }
 
 void
     testA2M(std::string const                            &out_file_name,
             std::string const                            &train_file,
             std::string const                            &true_wild_type,
+            Ensemble const                               &ensemble,
             std::tuple<PWM_1, PWM_2, PWM_3, PWM_4> const &pwms,
             int                                           order,
             int                                           true_offset,
-            bool                                          use_threads,
-            double                                        c,
-            bool                                          use_bias)
+            ThreadPool                                   &pool)
 {
   assert(order < 5 and order > 0);
   std::ofstream ofs{ out_file_name + ".scores" };
@@ -860,47 +2025,95 @@ void
                   std::end(wild_type));
 
   std::ofstream fails{ out_file_name + ".fails" };
-  auto const   &mutants = generateMutants(
-      train_file, true_wild_type, valid_positions, true_offset, fails);
+  auto const   &mutants = generateMutants(train_file,
+                                         true_wild_type,
+                                         valid_positions,
+                                         true_offset,
+                                         ensemble,
+                                         fails);
+
+  // the wild type is scored once; a mutant's score is the wild type's plus
+  // the change in the terms that touch its mutated positions
+  auto const encoded_wild_type = ensemble.encode(wild_type);
+  std::vector<double>              wt_scores(order);
+  std::vector<std::vector<double>> wt_sums(order);
+  switch (order)
+  {
+    case 4:
+      wt_scores[3] = std::get<3>(pwms).evaluate(encoded_wild_type);
+      wt_sums[3]   = std::get<3>(pwms).termSums(encoded_wild_type);
+      [[fallthrough]];
+    case 3:
+      wt_scores[2] = std::get<2>(pwms).evaluate(encoded_wild_type);
+      wt_sums[2]   = std::get<2>(pwms).termSums(encoded_wild_type);
+      [[fallthrough]];
+    case 2:
+      wt_scores[1] = std::get<1>(pwms).evaluate(encoded_wild_type);
+      wt_sums[1]   = std::get<1>(pwms).termSums(encoded_wild_type);
+      [[fallthrough]];
+    case 1:
+      wt_scores[0] = std::get<0>(pwms).evaluate(encoded_wild_type);
+      wt_sums[0]   = std::get<0>(pwms).termSums(encoded_wild_type);
+  }
 
-  for (auto const &[descriptor, mutations, valid_mutation] : mutants)
+  auto const write_rows =
+      [&](std::size_t first, std::size_t last, std::ostream &out)
   {
-    ofs << descriptor;
-    auto sequence = wild_type;
-    for (auto [pos, rep] : mutations)
-      sequence[pos] = rep;
-    switch (order)
+    auto             sequence = encoded_wild_type;
+    std::vector<int> changed;
+    for (auto m = first; m < last; ++m)
     {
-      case 4:
-        if (not valid_mutation)
-          ofs << ";";
-        else
-          ofs << ";"
-              << std::get<3>(pwms).evaluate(sequence, use_threads, c, use_bias);
-        [[fallthrough]];
-      case 3:
-        if (not valid_mutation)
-          ofs << ";";
-        else
-          ofs << ";"
-              << std::get<2>(pwms).evaluate(sequence, use_threads, c, use_bias);
-        [[fallthrough]];
-      case 2:
-        if (not valid_mutation)
-          ofs << ";";
-        else
-          ofs << ";"
-              << std::get<1>(pwms).evaluate(sequence, use_threads, c, use_bias);
-        [[fallthrough]];
-      case 1:
-        if (not valid_mutation)
-          ofs << ";";
-        else
-          ofs << ";"
-              << std::get<0>(pwms).evaluate(sequence, use_threads, c, use_bias);
+      out << mutants[m].descriptor;
+      if (not mutants[m].valid_mutation)
+      {
+        out << std::string(order, ';') << "\n";
+        continue;
+      }
+
+      for (auto [pos, rep] : mutants[m].mutations)
+        sequence[pos] = rep;
+      changed.clear();
+      for (int i = 0; i < static_cast<int>(sequence.size()); ++i)
+        if (sequence[i] != encoded_wild_type[i])
+          changed.push_back(i);
+
+      switch (order)
+      {
+        case 4:
+          out << ";"
+              << wt_scores[3] + std::get<3>(pwms).delta(encoded_wild_type,
+                                                        sequence,
+                                                        changed,
+                                                        wt_sums[3]);
+          [[fallthrough]];
+        case 3:
+          out << ";"
+              << wt_scores[2] + std::get<2>(pwms).delta(encoded_wild_type,
+                                                        sequence,
+                                                        changed,
+                                                        wt_sums[2]);
+          [[fallthrough]];
+        case 2:
+          out << ";"
+              << wt_scores[1] + std::get<1>(pwms).delta(encoded_wild_type,
+                                                        sequence,
+                                                        changed,
+                                                        wt_sums[1]);
+          [[fallthrough]];
+        case 1:
+          out << ";"
+              << wt_scores[0] + std::get<0>(pwms).delta(encoded_wild_type,
+                                                        sequence,
+                                                        changed,
+                                                        wt_sums[0]);
+      }
+      out << "\n";
+
+      for (auto [pos, rep] : mutants[m].mutations)
+        sequence[pos] = encoded_wild_type[pos];
     }
-    ofs << "\n";
-  }
+  };
+  writeInOrder(ofs, mutants.size(), pool, write_rows);
   std::cout << "All test sequences are scored.\n" << std::flush;
 }
 
@@ -908,10 +2121,9 @@ void
     test(std::string const                            &out_file_name,
          std::string const                            &train_column,
          std::vector<Sequence> const                  &sequences,
+         Ensemble const                               &ensemble,
          std::tuple<PWM_1, PWM_2, PWM_3, PWM_4> const &pwms,
-         int                                           order,
-         double                                        c,
-         bool                                          use_bias)
+         int                                           order)
 {
   assert(order < 5 and order > 0);
   std::ofstream ofs{ out_file_name + ".scores" };
@@ -933,31 +2145,31 @@ void
   }
 
   ofs << "\n";
+  std::vector<std::vector<std::uint8_t>> codes;
   for (auto const &sequence : sequences)
+    codes.push_back(ensemble.encode(sequence.sequence));
+
+  std::vector<std::vector<double>> scores(order);
+  switch (order)
   {
-    ofs << sequence.label;
-    switch (order)
-    {
-      case 4:
-        ofs << ","
-            << std::get<3>(pwms).evaluate(
-                   sequence.sequence, false, c, use_bias);
-        [[fallthrough]];
-      case 3:
-        ofs << ","
-            << std::get<2>(pwms).evaluate(
-                   sequence.sequence, false, c, use_bias);
-        [[fallthrough]];
-      case 2:
-        ofs << ","
-            << std::get<1>(pwms).evaluate(
-                   sequence.sequence, false, c, use_bias);
-        [[fallthrough]];
-      case 1:
-        ofs << ","
-            << std::get<0>(pwms).evaluate(
-                   sequence.sequence, false, c, use_bias);
-    }
+    case 4:
+      scores[3] = std::get<3>(pwms).evaluate(codes);
+      [[fallthrough]];
+    case 3:
+      scores[2] = std::get<2>(pwms).evaluate(codes);
+      [[fallthrough]];
+    case 2:
+      scores[1] = std::get<1>(pwms).evaluate(codes);
+      [[fallthrough]];
+    case 1:
+      scores[0] = std::get<0>(pwms).evaluate(codes);
+  }
+
+  for (std::size_t n = 0; n < sequences.size(); ++n)
+  {
+    ofs << sequences[n].label;
+    for (int k = order; k > 0; --k)
+      ofs << "," << scores[k - 1][n];
     ofs << "\n";
   }
   std::cout << "All test sequences are scored.\n" << std::flush;
@@ -1,145 +1,466 @@
 
 #pragma once
 
+#include <array>
+#include <atomic>
 #include <chrono>
 #include <iostream>
 #include <map>
+#include <memory>
 #include <set>
 #include <string>
+#include <string_view>
 #include <tuple>
 #include <unordered_map>
 #include <utility>
 #include <vector>
 
+#include "cooccurrence.hpp"
 #include "ensemble.hpp"
+#include "tables.hpp"
+#include "threadpool.hpp"
 
 namespace sic
 {
-class PWM_1
+// score changes of single substitutions of the wild type, keyed by
+// (position, symbol code) and computed on first use; lookups are lock-free
+class SubstitutionCache
 {
 private:
-  std::map<std::tuple<int, char>, double> pwm;
-  std::vector<std::map<char, double>>     pwm_t;
-  Summary                                 summary;
+  struct Slot
+  {
+    std::atomic<bool>   ready{ false };
+    std::atomic<double> delta{ 0.0 };
+  };
+
+  int                      A;
+  std::unique_ptr<Slot[]>  slots;
+  std::atomic<std::size_t> hits{ 0 };
+  std::atomic<std::size_t> misses{ 0 };
 
 public:
+  SubstitutionCache(int L, int A)
+      : A(A), slots(std::make_unique<Slot[]>(std::size_t(L) * A))
+  {
+  }
+
+  // the cached delta of rep at pos, from compute() if it is not cached yet
+  template <typename Compute>
   double
-      evaluate(std::string const &sequence, bool use_threads, double c, bool use_bias) const;
-  PWM_1(Ensemble const &ensemble, bool use_threads);
+      delta(int pos, std::uint8_t rep, Compute &&compute)
+  {
+    auto &slot = slots[std::size_t(pos) * A + rep];
+    if (slot.ready.load(std::memory_order_acquire))
+    {
+      hits.fetch_add(1, std::memory_order_relaxed);
+      return slot.delta.load(std::memory_order_relaxed);
+    }
+    misses.fetch_add(1, std::memory_order_relaxed);
+    auto const value = compute();
+    slot.delta.store(value, std::memory_order_relaxed);
+    slot.ready.store(true, std::memory_order_release);
+    return value;
+  }
+
+  // prints the lookups made so far and the fraction of them that hit
+  void print(std::string const &name) const;
+};
+
+class PWM_1
+{
+private:
+  // L x (D + 1) log-scores, indexed by i * (D + 1) + symbol code
+  std::vector<double> pwm;
+  Summary             summary;
+
+public:
+  double evaluate(std::vector<std::uint8_t> const &sequence) const;
+  // the scores of many sequences, equal to evaluating them one at a time
+  std::vector<double>
+      evaluate(std::vector<std::vector<std::uint8_t>> const &sequences) const;
+  // the sum of the terms of sequence that touch each position
+  std::vector<double>
+      termSums(std::vector<std::uint8_t> const &sequence) const;
+  // score of to minus that of from, from the terms that touch the
+  // increasing positions changed; from_sums are the termSums of from
+  double delta(std::vector<std::uint8_t> const &from,
+               std::vector<std::uint8_t> const &to,
+               std::vector<int> const          &changed,
+               std::vector<double> const       &from_sums) const;
+  PWM_1(Ensemble const &ensemble, ThreadPool &pool, double c, bool use_bias);
   PWM_1() = default;
 };
 
 class WT_PWM_1
 {
 private:
-  std::map<std::tuple<int, char>, double> wt_pwm;
-  double                                  wt_score;
-  Summary                                 summary;
+  // log-score of the wild type's symbol at each position
+  std::vector<double> wt_terms;
+  double              wt_score;
+  Summary             summary;
+  double              pseudo_count;
+  std::vector<double> biased_D;
+  // the sequences carrying a mutant's symbol
+  std::shared_ptr<ResidueIndex const> residues;
+  std::unique_ptr<SubstitutionCache>  cache;
+
+  // the score change of the wild type from rep at pos
+  double substitution(Ensemble const &ensemble,
+                      int             pos,
+                      std::uint8_t    rep) const;
 
 public:
-  double
-      evaluate(Ensemble const &ensemble, Mutant const &mutant, double c, bool use_bias) const;
+  double evaluate(Ensemble const &ensemble, Mutant const &mutant) const;
+
+  SubstitutionCache const &
+      substitutions() const
+  {
+    return *cache;
+  }
 
-  WT_PWM_1(Ensemble const &ensemble, double c, bool use_bias);
+  WT_PWM_1(Ensemble const                     &ensemble,
+           double                              c,
+           bool                                use_bias,
+           std::shared_ptr<ResidueIndex const> residues);
   WT_PWM_1() = default;
 };
 
 class PWM_2
 {
 private:
-  std::map<std::tuple<int, int, char, char>, double>         pwm;
-  std::vector<std::map<std::tuple<int, char, char>, double>> pwm_t;
-  Summary                                                    summary;
+  // L(L-1)/2 x (D + 1) x (D + 1) log-scores, indexed by
+  // (pairIndex(i, j, L) * (D + 1) + code_i) * (D + 1) + code_j
+  std::vector<double> pwm;
+  Summary             summary;
 
 public:
-  double
-      evaluate(std::string const &sequence, bool use_threads, double c, bool use_bias) const;
-  PWM_2(Ensemble const &ensemble, bool use_threads);
+  double evaluate(std::vector<std::uint8_t> const &sequence) const;
+  std::vector<double>
+      evaluate(std::vector<std::vector<std::uint8_t>> const &sequences) const;
+  std::vector<double>
+      termSums(std::vector<std::uint8_t> const &sequence) const;
+  double delta(std::vector<std::uint8_t> const &from,
+               std::vector<std::uint8_t> const &to,
+               std::vector<int> const          &changed,
+               std::vector<double> const       &from_sums) const;
+  // counts by scanning the ensemble, or from index if one is given
+  PWM_2(Ensemble const          &ensemble,
+        ThreadPool              &pool,
+        double                   c,
+        bool                     use_bias,
+        CooccurrenceIndex const *index);
   PWM_2() = default;
 };
 
 class WT_PWM_2
 {
 private:
-  std::map<std::tuple<int, int, char, char>, double> wt_pwm;
-  double                                             wt_score;
-  Summary                                            summary;
+  // log-scores of the wild type's pairs, indexed by pairIndex(i, j, L)
+  std::vector<double> wt_terms;
+  double              wt_score;
+  Summary             summary;
+  double              pseudo_count;
+  std::vector<double> biased_D;
+  // conditional counts come from here if set, else from scanning the
+  // sequences of residues that carry the mutant's symbol
+  std::shared_ptr<CooccurrenceIndex const> index;
+  std::shared_ptr<ResidueIndex const>      residues;
+  std::unique_ptr<SubstitutionCache>       cache;
+
+  double substitution(Ensemble const &ensemble,
+                      int             pos,
+                      std::uint8_t    rep) const;
 
 public:
-  double
-      evaluate(Ensemble const &ensemble, Mutant const &mutant, double c, bool use_bias) const;
+  double evaluate(Ensemble const &ensemble, Mutant const &mutant) const;
+
+  SubstitutionCache const &
+      substitutions() const
+  {
+    return *cache;
+  }
 
-  WT_PWM_2(Ensemble const &ensemble, double c, bool use_bias);
+  WT_PWM_2(Ensemble const                          &ensemble,
+           double                                   c,
+           bool                                     use_bias,
+           std::shared_ptr<CooccurrenceIndex const> index,
+           std::shared_ptr<ResidueIndex const>      residues);
   WT_PWM_2() = default;
 };
 
 class PWM_3
 {
 private:
-  std::map<std::tuple<int, int, int, char, char, char>, double>         pwm;
-  std::vector<std::map<std::tuple<int, int, char, char, char>, double>> pwm_t;
-  Summary                                                               summary;
+  // log-scores keyed by tripleIndex(i, j, k, L) * (D + 1)^3 + symbol codes
+  TermTable  pwm;
+  Summary    summary;
+  TupleRanks ranks;
 
 public:
-  double
-      evaluate(std::string const &sequence, bool use_threads, double c, bool use_bias) const;
-  PWM_3(Ensemble const &ensemble, bool use_threads);
+  double evaluate(std::vector<std::uint8_t> const &sequence) const;
+  std::vector<double>
+      evaluate(std::vector<std::vector<std::uint8_t>> const &sequences) const;
+  std::vector<double>
+      termSums(std::vector<std::uint8_t> const &sequence) const;
+  double delta(std::vector<std::uint8_t> const &from,
+               std::vector<std::uint8_t> const &to,
+               std::vector<int> const          &changed,
+               std::vector<double> const       &from_sums) const;
+  // external tables buffer at most memory_budget bytes
+  PWM_3(Ensemble const          &ensemble,
+        ThreadPool              &pool,
+        Backend                  backend,
+        std::size_t              memory_budget,
+        double                   c,
+        bool                     use_bias,
+        CooccurrenceIndex const *index);
   PWM_3() = default;
 };
 
 class WT_PWM_3
 {
 private:
-  std::map<std::tuple<int, int, int, char, char, char>, double> wt_pwm;
-  double                                                        wt_score;
-  Summary                                                       summary;
+  // log-scores of the wild type's triples, keyed by tripleIndex(i, j, k, L)
+  TermTable wt_pwm;
+  double    wt_score;
+  Summary   summary;
+  double    pseudo_count;
+  std::shared_ptr<CooccurrenceIndex const> index;
+  std::shared_ptr<ResidueIndex const>      residues;
+  std::unique_ptr<SubstitutionCache>       cache;
+
+  double substitution(Ensemble const &ensemble,
+                      int             pos,
+                      std::uint8_t    rep) const;
 
 public:
-  double
-      evaluate(Ensemble const &ensemble, Mutant const &mutant, double c, bool use_bias) const;
+  double evaluate(Ensemble const &ensemble, Mutant const &mutant) const;
 
-  WT_PWM_3(Ensemble const &ensemble, double c, bool use_bias);
+  SubstitutionCache const &
+      substitutions() const
+  {
+    return *cache;
+  }
+
+  WT_PWM_3(Ensemble const                          &ensemble,
+           double                                   c,
+           bool                                     use_bias,
+           Backend                                  backend,
+           std::shared_ptr<CooccurrenceIndex const> index,
+           std::shared_ptr<ResidueIndex const>      residues);
   WT_PWM_3() = default;
 };
 
+class WT_PWM_4
+{
+private:
+  // the log-scores of the wild type's quadruples, summed over those through
+  // each position; the C(L, 4) quadruples themselves are never stored
+  std::vector<double> wt_sums;
+  double              wt_score;
+  Summary             summary;
+  double              pseudo_count;
+  std::shared_ptr<ResidueIndex const> residues;
+  std::unique_ptr<SubstitutionCache>  cache;
+
+  double substitution(Ensemble const &ensemble,
+                      int             pos,
+                      std::uint8_t    rep) const;
+
+public:
+  double evaluate(Ensemble const &ensemble, Mutant const &mutant) const;
+
+  SubstitutionCache const &
+      substitutions() const
+  {
+    return *cache;
+  }
+
+  WT_PWM_4(Ensemble const                     &ensemble,
+           ThreadPool                         &pool,
+           double                              c,
+           bool                                use_bias,
+           std::shared_ptr<ResidueIndex const> residues);
+  WT_PWM_4() = default;
+};
+
 class PWM_4
 {
 private:
-  std::map<std::tuple<int, int, int, int, char, char, char, char>, double> pwm;
-  Summary summary;
+  // log-scores keyed by quadIndex(i, j, k, l, L) * (D + 1)^4 + symbol codes
+  TermTable  pwm;
+  Summary    summary;
+  TupleRanks ranks;
 
 public:
-  double
-      evaluate(std::string const &sequence, bool use_threads, double c, bool use_bias) const;
-  PWM_4(Ensemble const &ensemble, bool use_threads);
+  double evaluate(std::vector<std::uint8_t> const &sequence) const;
+  std::vector<double>
+      evaluate(std::vector<std::vector<std::uint8_t>> const &sequences) const;
+  std::vector<double>
+      termSums(std::vector<std::uint8_t> const &sequence) const;
+  double delta(std::vector<std::uint8_t> const &from,
+               std::vector<std::uint8_t> const &to,
+               std::vector<int> const          &changed,
+               std::vector<double> const       &from_sums) const;
+  PWM_4(Ensemble const &ensemble,
+        ThreadPool     &pool,
+        Backend         backend,
+        std::size_t     memory_budget,
+        double          c,
+        bool            use_bias);
   PWM_4() = default;
 };
 
+// a substitution of the wild type's residue at a position of the ensemble
+struct Mutation
+{
+  int          position;
+  std::uint8_t residue;   // encoded
+};
+
+// one mutant of a Mutants, viewing the storage of its descriptor and
+// mutations there
 struct Mutant
 {
-  std::string                        descriptor;
-  std::vector<std::tuple<int, char>> mutations;
-  bool                               valid_mutation;
+  struct Mutations
+  {
+    Mutation const *first;
+    Mutation const *last;
+
+    Mutation const *
+        begin() const
+    {
+      return first;
+    }
+    Mutation const *
+        end() const
+    {
+      return last;
+    }
+  };
+
+  std::string_view descriptor;
+  Mutations        mutations;
+  bool             valid_mutation;
+};
+
+// the mutants of a testing file, their descriptors and mutations stored
+// flat and delimited by per-mutant offsets
+class Mutants
+{
+private:
+  std::string               descriptors;
+  std::vector<std::size_t>  descriptor_offsets{ 0 };
+  std::vector<Mutation>     mutations;
+  std::vector<std::size_t>  mutation_offsets{ 0 };
+  std::vector<std::uint8_t> valid;
+
+public:
+  std::size_t
+      size() const
+  {
+    return valid.size();
+  }
+
+  Mutant
+      operator[](std::size_t m) const
+  {
+    return { std::string_view{ descriptors }.substr(
+                 descriptor_offsets[m],
+                 descriptor_offsets[m + 1] - descriptor_offsets[m]),
+             { mutations.data() + mutation_offsets[m],
+               mutations.data() + mutation_offsets[m + 1] },
+             valid[m] != 0 };
+  }
+
+  // appends a valid mutant without mutations
+  void
+      add(std::string_view descriptor)
+  {
+    descriptors.append(descriptor);
+    descriptor_offsets.push_back(descriptors.size());
+    mutation_offsets.push_back(mutations.size());
+    valid.push_back(1);
+  }
+
+  // appends a mutation to the last mutant, which is invalid if it is
+  void
+      addMutation(Mutation mutation, bool valid_mutation)
+  {
+    mutations.push_back(mutation);
+    ++mutation_offsets.back();
+    valid.back() &= valid_mutation;
+  }
+};
+
+// estimates the number of distinct (positions, symbols) terms of a PWM of the
+// given order, by counting them exactly on a sample of position tuples
+std::size_t estimateDistinctTerms(Ensemble const &ensemble, int order);
+
+// estimated peak memory of the PWMs up to an order, and the order 3 and 4
+// backends that keep it within max_memory, or within physical memory without
+// one; throws if none does
+class MemoryPlan
+{
+private:
+  int                        order      = 1;
+  unsigned                   threads    = 1;
+  std::size_t                max_memory = 0;   // bytes, 0 for no limit
+  std::size_t                index      = 0;   // bytes of the bitset index
+  std::array<Backend, 5>     backends{};       // by order
+  std::array<std::size_t, 5> terms{};          // estimated distinct terms
+  std::array<std::size_t, 5> bytes{};          // estimated peak memory
+  std::array<std::size_t, 5> disk{};           // of external tables
+  std::array<std::size_t, 5> budgets{};        // of external tables
+
+public:
+  MemoryPlan(Ensemble const &ensemble,
+             int             order,
+             unsigned        threads,
+             Backend         backend,
+             CountEngine     engine,
+             std::size_t     max_memory);
+  MemoryPlan() = default;
+
+  Backend
+      backend(int order) const
+  {
+    return backends[order];
+  }
+
+  // bytes an external table of the order may buffer in memory
+  std::size_t
+      externalBudget(int order) const
+  {
+    return budgets[order];
+  }
+
+  void print() const;
 };
 
-std::tuple<PWM_1, PWM_2, PWM_3, PWM_4>
-    generatePWMs(Ensemble const &ensemble, int order, bool use_threads);
+std::tuple<PWM_1, PWM_2, PWM_3, PWM_4> generatePWMs(Ensemble const   &ensemble,
+                                                    int               order,
+                                                    ThreadPool       &pool,
+                                                    MemoryPlan const &plan,
+                                                    CountEngine       engine,
+                                                    double            c,
+                                                    bool              use_bias);
 
 void test(std::string const                            &out_file_name,
           std::string const                            &train_column,
           std::vector<Sequence> const                  &sequences,
+          Ensemble const                               &ensemble,
           std::tuple<PWM_1, PWM_2, PWM_3, PWM_4> const &pwms,
-          int                                           order,
-          double                                        c);
+          int                                           order);
 
 void testA2M(std::string const                            &out_file_name,
              std::string const                            &train_file,
              std::string const                            &true_wild_type,
+             Ensemble const                               &ensemble,
              std::tuple<PWM_1, PWM_2, PWM_3, PWM_4> const &pwms,
              int                                           order,
              int                                           true_offset,
-             bool                                          use_threads,
-             double                                        c, bool use_bias);
+             ThreadPool                                   &pool);
 
 void testA2MWithoutPWMs(std::string const &out_file_name,
                         std::string const &train_file,
@@ -147,8 +468,11 @@ void testA2MWithoutPWMs(std::string const &out_file_name,
                         Ensemble const    &ensemble,
                         int                order,
                         int                true_offset,
-                        bool               use_threads,
-                        double             c, bool use_bias);
+                        ThreadPool        &pool,
+                        double             c,
+                        bool               use_bias,
+                        Backend            backend,
+                        CountEngine        engine);
 
 bool mutateSequence(std::string            &sequence,
                     std::string const      &col,
@@ -157,10 +481,11 @@ bool mutateSequence(std::string            &sequence,
                     int                     true_offset,
                     std::ofstream          &fails);
 
-std::vector<Mutant> generateMutants(std::string const      &train_file,
-                                    std::string const      &true_wild_type,
-                                    std::vector<int> const &valid_positions,
-                                    int                     true_offset,
-                                    std::ofstream          &fails);
+Mutants generateMutants(std::string const      &train_file,
+                        std::string const      &true_wild_type,
+                        std::vector<int> const &valid_positions,
+                        int                     true_offset,
+                        Ensemble const         &ensemble,
+                        std::ofstream          &fails);
 
 }   // namespace sic
@@ -0,0 +1,362 @@
+
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "external.hpp"
+
+namespace sic
+{
+// number of ways to choose k of n positions
+inline std::uint64_t
+    combinations(std::uint64_t n, std::uint64_t k)
+{
+  if (k > n)
+    return 0;
+  std::uint64_t result = 1;
+  for (std::uint64_t i = 0; i < k; ++i)
+    result = result * (n - i) / (i + 1);
+  return result;
+}
+
+// index of the pair (i, j), i < j < L, when the strict upper triangle of an
+// L x L matrix is stored row by row
+inline std::size_t
+    pairIndex(std::size_t i, std::size_t j, std::size_t L)
+{
+  return i * (2 * L - i - 1) / 2 + (j - i - 1);
+}
+
+inline std::size_t
+    pairCount(std::size_t L)
+{
+  return L * (L - 1) / 2;
+}
+
+// the pairs (i, j), i < j < L, in pairIndex order
+inline std::vector<std::pair<int, int>>
+    allPairs(int L)
+{
+  std::vector<std::pair<int, int>> pairs;
+  pairs.reserve(pairCount(std::max(L, 1)));
+  for (int i = 0; i < L; ++i)
+    for (int j = i + 1; j < L; ++j)
+      pairs.emplace_back(i, j);
+  return pairs;
+}
+
+// lexicographic index of the triple i < j < k < L; the same order in which
+// nested loops over i, j, k visit triples
+inline std::size_t
+    tripleIndex(std::size_t i, std::size_t j, std::size_t k, std::size_t L)
+{
+  return combinations(L, 3) - combinations(L - i, 3) +
+         pairIndex(j - i - 1, k - i - 1, L - i - 1);
+}
+
+// lexicographic index of the quadruple i < j < k < l < L
+inline std::size_t
+    quadIndex(std::size_t i,
+              std::size_t j,
+              std::size_t k,
+              std::size_t l,
+              std::size_t L)
+{
+  return combinations(L, 4) - combinations(L - i, 4) +
+         tripleIndex(j - i - 1, k - i - 1, l - i - 1, L - i - 1);
+}
+
+// lexicographic indices of tuples of positions, as tripleIndex and quadIndex
+// compute them, but from tables of binomial coefficients
+class TupleRanks
+{
+private:
+  std::size_t                L = 0;
+  std::vector<std::uint64_t> c2, c3, c4;   // ck[n] is n choose k
+
+public:
+  TupleRanks() = default;
+  explicit TupleRanks(int L) : L(L), c2(L + 1), c3(L + 1), c4(L + 1)
+  {
+    for (int n = 0; n <= L; ++n)
+    {
+      c2[n] = combinations(n, 2);
+      c3[n] = combinations(n, 3);
+      c4[n] = combinations(n, 4);
+    }
+  }
+
+  std::uint64_t
+      triple(std::size_t i, std::size_t j, std::size_t k) const
+  {
+    return c3[L] - c3[L - i] + c2[L - i - 1] - c2[L - j] + (k - j - 1);
+  }
+
+  std::uint64_t
+      quad(std::size_t i, std::size_t j, std::size_t k, std::size_t l) const
+  {
+    return c4[L] - c4[L - i] + c3[L - i - 1] - c3[L - j] + c2[L - j - 1] -
+           c2[L - k] + (l - k - 1);
+  }
+};
+
+// Open addressing hash map from packed 64-bit keys to doubles, with linear
+// probing. Entries are never erased.
+class HashTable
+{
+private:
+  static constexpr std::uint64_t empty_key = ~std::uint64_t{ 0 };
+
+  struct Entry
+  {
+    std::uint64_t key;
+    double        value;
+  };
+
+  std::vector<Entry> entries;
+  std::size_t        used = 0;
+
+  static std::uint64_t
+      hash(std::uint64_t key)
+  {
+    // splitmix64 finalizer; packed keys are far from uniformly distributed
+    key ^= key >> 30;
+    key *= 0xbf58476d1ce4e5b9ULL;
+    key ^= key >> 27;
+    key *= 0x94d049bb133111ebULL;
+    key ^= key >> 31;
+    return key;
+  }
+
+  std::size_t
+      slot(std::uint64_t key) const
+  {
+    auto const mask = entries.size() - 1;
+    auto       s    = hash(key) & mask;
+    while (entries[s].key != key and entries[s].key != empty_key)
+      s = (s + 1) & mask;
+    return s;
+  }
+
+  void
+      rehash(std::size_t capacity)
+  {
+    auto old = std::move(entries);
+    entries.assign(capacity, { empty_key, 0.0 });
+    for (auto const &entry : old)
+      if (entry.key != empty_key)
+        entries[slot(entry.key)] = entry;
+  }
+
+public:
+  // size the table for n keys at a load factor of at most 1/2
+  void
+      reserve(std::size_t n)
+  {
+    std::size_t capacity = 16;
+    while (capacity < 2 * n)
+      capacity *= 2;
+    if (capacity > entries.size())
+      rehash(capacity);
+  }
+
+  void
+      clear()
+  {
+    std::fill(std::begin(entries), std::end(entries), Entry{ empty_key, 0.0 });
+    used = 0;
+  }
+
+  std::size_t
+      size() const
+  {
+    return used;
+  }
+
+  std::size_t
+      capacity() const
+  {
+    return entries.size();
+  }
+
+  double &
+      operator[](std::uint64_t key)
+  {
+    if (2 * (used + 1) > entries.size())
+      reserve(used + 1);
+    auto const s = slot(key);
+    if (entries[s].key == empty_key)
+    {
+      entries[s].key = key;
+      ++used;
+    }
+    return entries[s].value;
+  }
+
+  double
+      find(std::uint64_t key, double missing = 0.0) const
+  {
+    if (entries.empty())
+      return missing;
+    auto const &entry = entries[slot(key)];
+    return entry.key == key ? entry.value : missing;
+  }
+
+  template <typename Function>
+  void
+      forEach(Function f)
+  {
+    for (auto &entry : entries)
+      if (entry.key != empty_key)
+        f(entry.key, entry.value);
+  }
+
+  template <typename Function>
+  void
+      forEach(Function f) const
+  {
+    for (auto const &entry : entries)
+      if (entry.key != empty_key)
+        f(entry.key, entry.value);
+  }
+};
+
+enum class Backend
+{
+  Auto,
+  Dense,
+  Sparse,
+  External
+};
+
+// bytes of records an external table buffers in memory before spilling
+constexpr std::size_t external_budget = std::size_t{ 256 } << 20;
+
+// values of terms keyed in [0, key_range), stored dense, sparse, or out of
+// core; absent keys read as an uncounted term
+class TermTable
+{
+private:
+  bool                           dense = true;
+  std::vector<double>            values;
+  HashTable                      entries;
+  std::shared_ptr<ExternalTable> external;
+  double                         missing = 0.0;
+
+public:
+  TermTable() = default;
+  TermTable(Backend       backend,
+            std::uint64_t key_range,
+            std::size_t   expected_keys,
+            std::size_t   memory_budget = external_budget)
+      : dense(backend != Backend::Sparse and backend != Backend::External)
+  {
+    if (dense)
+      values.assign(key_range, 0.0);
+    else if (backend == Backend::External)
+      external = std::make_shared<ExternalTable>(memory_budget);
+    else
+      entries.reserve(expected_keys);
+  }
+
+  bool
+      isDense() const
+  {
+    return dense;
+  }
+
+  bool
+      isExternal() const
+  {
+    return external != nullptr;
+  }
+
+  // not for external tables
+  double &
+      operator[](std::uint64_t key)
+  {
+    assert(not external);
+    return dense ? values[key] : entries[key];
+  }
+
+  void
+      add(std::uint64_t key, double value)
+  {
+    if (external)
+      external->add(key, value);
+    else
+      (*this)[key] += value;
+  }
+
+  double
+      find(std::uint64_t key) const
+  {
+    if (external)
+      return external->find(key, missing);
+    return dense ? values[key] : entries.find(key, missing);
+  }
+
+  // not for external tables, whose terms are only read back by find
+  template <typename Function>
+  void
+      forEach(Function f)
+  {
+    assert(not external);
+    if (dense)
+      for (std::uint64_t key = 0; key < values.size(); ++key)
+        f(key, values[key]);
+    else
+      entries.forEach(f);
+  }
+
+  template <typename Function>
+  void
+      forEach(Function f) const
+  {
+    assert(not external);
+    if (dense)
+      for (std::uint64_t key = 0; key < values.size(); ++key)
+        f(key, values[key]);
+    else
+      entries.forEach(f);
+  }
+
+  // replaces every value v, including the one read for absent keys, by f(v)
+  template <typename Function>
+  void
+      transform(Function f)
+  {
+    if (external)
+      external->finish(f);
+    else
+      forEach([&](std::uint64_t, double &value) { value = f(value); });
+    missing = f(missing);
+  }
+
+  // adds the values of other into this table; other may be left empty.
+  // Either both tables are external or neither is, as the terms of an
+  // external table cannot be read back one by one
+  void
+      merge(TermTable &other)
+  {
+    assert(isExternal() == other.isExternal());
+    if (external)
+    {
+      external->absorb(*other.external);
+      return;
+    }
+    other.forEach(
+        [this](std::uint64_t key, double value)
+        {
+          if (value != 0.0)
+            (*this)[key] += value;
+        });
+  }
+};
+}   // namespace sic
@@ -0,0 +1,175 @@
+
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace sic
+{
+// worker threads started once and shared by every parallel stage; a pool
+// of size one runs everything on the calling thread
+class ThreadPool
+{
+private:
+  struct Range
+  {
+    std::mutex  mutex;
+    std::size_t begin = 0;
+    std::size_t end   = 0;
+  };
+
+  unsigned                                    threads;
+  std::vector<std::thread>                    workers;
+  std::unique_ptr<Range[]>                    ranges;
+  std::function<void(std::size_t, unsigned)> job;
+  std::exception_ptr                          error;
+
+  std::mutex              mutex;
+  std::condition_variable start;
+  std::condition_variable done;
+  std::size_t             generation = 0;
+  unsigned                busy       = 0;
+  bool                    stopping   = false;
+
+  bool
+      next(unsigned worker, std::size_t &task)
+  {
+    {
+      std::lock_guard<std::mutex> lock{ ranges[worker].mutex };
+      if (ranges[worker].begin < ranges[worker].end)
+      {
+        task = ranges[worker].begin++;
+        return true;
+      }
+    }
+    for (unsigned v = 1; v < threads; ++v)
+    {
+      auto       &victim = ranges[(worker + v) % threads];
+      std::size_t begin, end;
+      {
+        std::lock_guard<std::mutex> lock{ victim.mutex };
+        if (victim.begin >= victim.end)
+          continue;
+        end        = victim.end;
+        begin      = victim.begin + (victim.end - victim.begin) / 2;
+        victim.end = begin;
+      }
+      std::lock_guard<std::mutex> lock{ ranges[worker].mutex };
+      ranges[worker].begin = begin + 1;
+      ranges[worker].end   = end;
+      task                 = begin;
+      return true;
+    }
+    return false;
+  }
+
+  void
+      run(unsigned worker)
+  {
+    std::size_t seen = 0;
+    for (;;)
+    {
+      {
+        std::unique_lock<std::mutex> lock{ mutex };
+        start.wait(lock,
+                   [&] { return stopping or generation != seen; });
+        if (stopping)
+          return;
+        seen = generation;
+      }
+      std::size_t task;
+      try
+      {
+        while (next(worker, task))
+          job(task, worker);
+      }
+      catch (...)
+      {
+        std::lock_guard<std::mutex> lock{ mutex };
+        if (not error)
+          error = std::current_exception();
+        // give up on the remaining tasks
+        for (unsigned w = 0; w < threads; ++w)
+        {
+          std::lock_guard<std::mutex> range_lock{ ranges[w].mutex };
+          ranges[w].begin = ranges[w].end;
+        }
+      }
+      std::lock_guard<std::mutex> lock{ mutex };
+      if (--busy == 0)
+        done.notify_one();
+    }
+  }
+
+public:
+  explicit ThreadPool(unsigned threads)
+      : threads(std::max(1u, threads)),
+        ranges(std::make_unique<Range[]>(this->threads))
+  {
+    if (this->threads > 1)
+      for (unsigned w = 0; w < this->threads; ++w)
+        workers.emplace_back(&ThreadPool::run, this, w);
+  }
+
+  ThreadPool(ThreadPool const &) = delete;
+  ThreadPool &operator=(ThreadPool const &) = delete;
+
+  ~ThreadPool()
+  {
+    {
+      std::lock_guard<std::mutex> lock{ mutex };
+      stopping = true;
+    }
+    start.notify_all();
+    for (auto &worker : workers)
+      worker.join();
+  }
+
+  unsigned
+      size() const
+  {
+    return threads;
+  }
+
+  // calls f(task, worker) for every task, worker < size() being unique among
+  // concurrent calls; rethrows the first exception thrown
+  template <typename F>
+  void
+      parallelFor(std::size_t tasks, F &&f)
+  {
+    if (workers.empty())
+    {
+      for (std::size_t task = 0; task < tasks; ++task)
+        f(task, 0u);
+      return;
+    }
+
+    job = [&f](std::size_t task, unsigned worker) { f(task, worker); };
+    for (unsigned w = 0; w < threads; ++w)
+    {
+      ranges[w].begin = tasks * w / threads;
+      ranges[w].end   = tasks * (w + 1) / threads;
+    }
+    {
+      std::lock_guard<std::mutex> lock{ mutex };
+      busy  = threads;
+      error = nullptr;
+      ++generation;
+    }
+    start.notify_all();
+
+    std::unique_lock<std::mutex> lock{ mutex };
+    done.wait(lock, [&] { return busy == 0; });
+    job = nullptr;
+    if (error)
+      std::rethrow_exception(error);
+  }
+};
+}   // namespace sic
@@ -0,0 +1,230 @@
+#!/bin/bash
+# scores the test data read from plain files, from gzip files, and through
+# pipes, which must all give the same scores, checks that weights are read as
+# std::stod reads them, that mutants scored as a change from the wild type
+# score as whole sequences do, that every table backend gives the same
+# scores, that sharding a sparse table over threads does not change them,
+# that both count engines give the same scores, and that collapsing identical
+# sequences before weighting does not change them
+set -e
+
+sicrun=$(realpath "${1:-./sicrun}")
+sicfiles=$(realpath "${2:-./sicfiles}")
+data=$(realpath "$(dirname "$0")")
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+cd "$work"
+
+gzip -c "$data/train.a2m" > train.a2m.gz
+gzip -c "$data/mutants.csv" > mutants.csv.gz
+mkfifo train.fifo mutants.fifo
+
+failures=0
+
+# runs the command and keeps its scores as name.result
+run()
+{
+  local name=$1
+  shift
+  rm -f ./*.scores
+  if ! timeout 60 "$@" > "$name.log" 2>&1 || ! ls ./*.scores > /dev/null 2>&1
+  then
+    echo "FAIL $name: no scores"
+    cat "$name.log"
+    failures=$((failures + 1))
+    return 1
+  fi
+  mv ./*.scores "$name.result"
+}
+
+# runs the command, whose scores must be the same as reference.result
+check()
+{
+  local name=$1 reference=$2
+  shift 2
+  run "$name" "$@" || return 0
+  if [ "$name" != "$reference" ] && ! cmp -s "$reference.result" "$name.result"
+  then
+    echo "FAIL $name: scores differ from $reference"
+    failures=$((failures + 1))
+    return
+  fi
+  echo "ok   $name"
+}
+
+# runs the command, whose scores must agree with every scored row of
+# reference.result to a relative 1e-5, the rounding of the six significant
+# digits both are written with; rows are matched by label, whose commas
+# become + as in a delimited file
+close()
+{
+  local name=$1 reference=$2
+  shift 2
+  run "$name" "$@" || return 0
+  if ! awk '
+    FNR == 1 { next }
+    {
+      n = split($0, field, ";")
+      if (n == 1)
+        n = split($0, field, ",")
+      label = field[1]
+      gsub(",", "+", label)
+    }
+    NR == FNR {
+      if (field[2] != "") {
+        expected[label] = $0
+        ++rows
+      }
+      next
+    }
+    label in expected {
+      m = split(expected[label], want, ";")
+      if (m != n)
+        ++bad
+      for (i = 2; i <= n; ++i) {
+        d = field[i] - want[i]
+        if (d < 0)
+          d = -d
+        if (d > 1e-5 * (want[i] < 0 ? -want[i] : want[i]))
+          ++bad
+      }
+      ++seen
+    }
+    END { exit bad > 0 || seen != rows || rows == 0 }
+  ' "$reference.result" "$name.result"
+  then
+    echo "FAIL $name: scores differ from $reference"
+    failures=$((failures + 1))
+    return
+  fi
+  echo "ok   $name"
+}
+
+a2m=$data/train.a2m
+mutants=$data/mutants.csv
+check plain plain "$sicrun" -if "$a2m" -of "$mutants"
+check gzip plain "$sicrun" -if train.a2m.gz -of mutants.csv.gz
+check pipe plain "$sicrun" -if <(cat "$a2m") -of <(cat "$mutants")
+check gzip-pipe plain "$sicrun" -if <(cat train.a2m.gz) -of <(cat mutants.csv.gz)
+cat "$a2m" > train.fifo &
+cat "$mutants" > mutants.fifo &
+check fifo plain "$sicrun" -if train.fifo -of mutants.fifo
+# writers left blocked by a run that never opened their pipe
+kill $(jobs -p) 2> /dev/null || true
+
+cat > weights.csv << 'EOF'
+sequence,weight
+ACGTACGTAC,0.5
+ACGTACGAAC,2
+ACCTACGTAC,1
+TCGTACGTAG,2
+ACGTTCGTAC,0.25
+EOF
+cat > signed.csv << 'EOF'
+sequence,weight
+ACGTACGTAC,+0.5
+ACGTACGAAC, 2
+ACCTACGTAC,1e0
+TCGTACGTAG,0x1p1
+ACGTTCGTAC,+.25
+EOF
+check weights weights "$sicfiles" -if weights.csv -isc sequence -wc weight \
+  -of weights.csv -osc sequence -o 2
+check signed-weights weights "$sicfiles" -if signed.csv -isc sequence \
+  -wc weight -of weights.csv -osc sequence -o 2
+
+# the alignment without its insert columns, and the mutants scored from it
+# as whole sequences, for sicfiles to score by evaluating every term
+check delta delta "$sicrun" -if "$a2m" -of "$mutants" -o 4
+awk 'BEGIN { RS = ">"; print "sequence" }
+  NR > 1 {
+    n = split($0, line, "\n")
+    sequence = ""
+    for (i = 2; i <= n; ++i)
+      sequence = sequence line[i]
+    if (NR == 2)
+      target = sequence
+    kept = ""
+    for (i = 1; i <= length(sequence); ++i)
+      if (substr(target, i, 1) !~ /[a-z]/)
+        kept = kept substr(sequence, i, 1)
+    print kept
+  }' "$a2m" > train.csv
+awk -v a2m="$a2m" '
+  BEGIN {
+    getline header < a2m
+    match(header, /\/[0-9]+-/)
+    offset = substr(header, RSTART + 1, RLENGTH - 2)
+    while ((getline line < a2m) > 0 && line !~ /^>/)
+      target = target line
+    print "label;sequence"
+  }
+  NR > 1 {
+    split($0, field, ";")
+    if (field[2] == "")
+      next
+    sequence = target
+    n = split(field[1], mutation, ",")
+    for (m = 1; m <= n; ++m)
+      if (mutation[m] != "WT") {
+        k = length(mutation[m])
+        p = substr(mutation[m], 2, k - 2) - offset + 1
+        sequence = substr(sequence, 1, p - 1) substr(mutation[m], k) \
+                   substr(sequence, p + 1)
+      }
+    kept = ""
+    for (i = 1; i <= length(sequence); ++i)
+      if (substr(target, i, 1) !~ /[a-z]/)
+        kept = kept substr(sequence, i, 1)
+    label = field[1]
+    gsub(",", "+", label)
+    print label ";" kept
+  }' delta.result > whole.csv
+close whole delta "$sicfiles" -if train.csv -isc sequence -of whole.csv \
+  -osc sequence -olc label -dlm ";" -o 4
+
+# a dense order 4 table holds C(L, 4) (D + 1)^4 terms, so order 4 is tested
+# on the first 12 columns of the alignment; several threads give an external
+# table several runs to merge
+awk 'BEGIN { RS = ">"; ORS = "" }
+  NR > 1 {
+    n = split($0, line, "\n")
+    sequence = ""
+    for (i = 2; i <= n; ++i)
+      sequence = sequence line[i]
+    print ">" line[1] "\n" substr(sequence, 1, 12) "\n"
+  }' "$a2m" > short.a2m
+check dense-3 dense-3 "$sicrun" -if "$a2m" -of "$mutants" -o 3 -tb dense
+check sparse-3 dense-3 "$sicrun" -if "$a2m" -of "$mutants" -o 3 -tb sparse
+check external-3 dense-3 "$sicrun" -if "$a2m" -of "$mutants" -o 3 \
+  -tb external -t 4
+check dense-4 dense-4 "$sicrun" -if short.a2m -of "$mutants" -o 4 -tb dense
+check sparse-4 dense-4 "$sicrun" -if short.a2m -of "$mutants" -o 4 -tb sparse
+check external-4 dense-4 "$sicrun" -if short.a2m -of "$mutants" -o 4 \
+  -tb external -t 4
+
+# a sparse table holds only the terms the alignment has, so the threads that
+# aggregate tuple sums are tested on the whole alignment
+run sparse-4-t1 "$sicrun" -if "$a2m" -of "$mutants" -o 4 -tb sparse -t 1
+check sparse-4-t4 sparse-4-t1 "$sicrun" -if "$a2m" -of "$mutants" -o 4 \
+  -tb sparse -t 4
+
+# the bitset engine sums its counts class by class; weights adjusted at 80%
+# similarity give the test data eight classes of weight
+check scan-3 scan-3 "$sicrun" -if "$a2m" -of "$mutants" -o 3 -ce scan
+check bitset-3 scan-3 "$sicrun" -if "$a2m" -of "$mutants" -o 3 -ce bitset
+check scan-3-weighted scan-3-weighted "$sicrun" -if "$a2m" -of "$mutants" \
+  -o 3 -a Y -sim 80 -ce scan
+check bitset-3-weighted scan-3-weighted "$sicrun" -if "$a2m" -of "$mutants" \
+  -o 3 -a Y -sim 80 -ce bitset
+
+# the test alignment has five groups of identical sequences to collapse
+check similar similar "$sicrun" -if "$a2m" -of "$mutants" -o 3 -a Y -sim 80 \
+  -dd N
+check similar-deduplicated similar "$sicrun" -if "$a2m" -of "$mutants" -o 3 \
+  -a Y -sim 80 -dd Y
+check uniform uniform "$sicrun" -if "$a2m" -of "$mutants" -o 3 -a U -dd N
+check uniform-deduplicated uniform "$sicrun" -if "$a2m" -of "$mutants" -o 3 \
+  -a U -dd Y
+
+[ "$failures" = 0 ]